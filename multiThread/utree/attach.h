@@ -0,0 +1,176 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <typeinfo>
+#include <vector>
+
+#include "pm_ptr.h"
+
+#ifndef USE_RELATIVE_PTR
+#error "attach.h reads the list through pool relative links, build with -DUSE_RELATIVE_PTR"
+#endif
+
+/*
+ * Read-only access to a live tree's shadow list from another process. The
+ * writer keeps a superblock in PM (btree::publish()) that says where the list
+ * head is and how its nodes are laid out; a reader maps the pools read-only,
+ * wherever mmap puts them, and walks the list from the head without building
+ * any DRAM pages.
+ *
+ * The writer links a node with one CAS on its predecessor's next after the
+ * node is written and flushed, and unlinks one with a CAS that skips it, so a
+ * reader that loads each next once (acquire) always lands on a complete node
+ * and keys only grow along the way. A node removed after the reader reached
+ * it still leads forward; it is skipped, and keys inserted behind the reader
+ * are not seen. Values are read as they are, one larger than 8 bytes can be
+ * torn by a concurrent update.
+ */
+namespace attach {
+
+constexpr uint64_t MAGIC = 0x31424c4545525475ULL;  // "uTREELB1"
+constexpr uint32_t LAYOUT_VERSION = 1;             // list_node_t, relative next
+constexpr size_t SUPERBLOCK_BYTES = 4096;          // reserved for it in the pool
+
+struct superblock {
+    uint64_t magic;             // written last
+    uint32_t version;
+    uint32_t node_bytes;
+    uint32_t key_bytes;
+    uint32_t value_bytes;
+    uint32_t key_offset;
+    uint32_t value_offset;
+    uint32_t delete_offset;
+    uint32_t next_offset;
+    uint64_t schema;            // hash of the key and value type names
+    uint64_t list_head;         // pm::rel_ptr bits
+    uint64_t pool_bytes[pm::MAX_POOLS + 1];
+};
+static_assert(sizeof(superblock) <= SUPERBLOCK_BYTES, "superblock outgrew its space");
+
+inline uint64_t fnv(uint64_t h, const char *s) {
+    for (; *s; ++s)
+        h = (h ^ (unsigned char)*s) * 0x100000001b3ULL;
+    return h;
+}
+
+// What a reader compiled with the same Node expects, magic left out.
+template <typename Node>
+superblock describe() {
+    superblock sb{};
+    sb.version = LAYOUT_VERSION;
+    sb.node_bytes = sizeof(Node);
+    sb.key_bytes = sizeof(Node::key);
+    sb.value_bytes = sizeof(Node::value);
+    sb.key_offset = offsetof(Node, key);
+    sb.value_offset = offsetof(Node, value);
+    sb.delete_offset = offsetof(Node, isDelete);
+    sb.next_offset = offsetof(Node, next);
+    sb.schema = fnv(fnv(0xcbf29ce484222325ULL, typeid(decltype(Node::key)).name()),
+                    typeid(decltype(Node::value)).name());
+    return sb;
+}
+
+template <typename Node>
+class reader {
+    std::vector<std::pair<char *, size_t>> maps;
+    const superblock *sb = nullptr;
+
+    static char *map(const std::string &path, size_t size) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return nullptr;
+        void *m = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        return m == MAP_FAILED ? nullptr : (char *)m;
+    }
+
+    // A link that lands on a whole node inside an attached pool.
+    const Node *follow(uint64_t raw) const {
+        uint64_t id = raw >> pm::OFFSET_BITS, off = raw & pm::OFFSET_MASK;
+        if (id == 0 || id > maps.size() || off % alignof(Node) != 0 || off + sizeof(Node) > maps[id - 1].second)
+            return nullptr;
+        return (const Node *)pm::to_abs(raw);
+    }
+
+    // Removed while a snapshot was open, still linked until reclaimVersions().
+    static bool dead(const Node *n) {
+#ifdef USE_SNAPSHOTS
+        return __atomic_load_n(&n->stamp, __ATOMIC_ACQUIRE) & Node::DEAD;
+#else
+        return false;
+#endif
+    }
+
+public:
+    /*
+     * Maps the files (or dax devices) of pools 1, 2, ... read-only and
+     * attaches them under those ids; the superblock is at offset in pool 1.
+     * Their sizes come from the superblock. valid() is false if a pool cannot
+     * be mapped or the superblock does not describe Node.
+     */
+    reader(const std::vector<std::string> &paths, size_t offset = 0) {
+        if (paths.empty() || paths.size() > pm::MAX_POOLS)
+            return;
+        char *head = map(paths[0], offset + SUPERBLOCK_BYTES);
+        if (head == nullptr)
+            return;
+        superblock want = describe<Node>(), got;
+        memcpy(&got, head + offset, sizeof(got));
+        munmap(head, offset + SUPERBLOCK_BYTES);
+        if (got.magic != MAGIC || memcmp((char *)&got + sizeof(uint64_t), (char *)&want + sizeof(uint64_t),
+                                         offsetof(superblock, list_head) - sizeof(uint64_t)) != 0)
+            return;
+        for (size_t i = 0; i < paths.size(); ++i) {
+            size_t size = got.pool_bytes[i + 1];
+            char *base = size > 0 ? map(paths[i], size) : nullptr;
+            if (base == nullptr)
+                return;
+            maps.emplace_back(base, size);
+            pm::attach(i + 1, base, size);
+        }
+        sb = (const superblock *)(maps[0].first + offset);
+    }
+
+    ~reader() {
+        for (auto &m : maps)
+            munmap(m.first, m.second);
+    }
+
+    bool valid() const { return sb != nullptr; }
+    const superblock &meta() const { return *sb; }
+
+    /*
+     * visit(key, value) for each node linked while the walk passes it, in key
+     * order. False if a link leads outside the attached pools or back in key
+     * order, which a pool from another tree or a torn superblock would do.
+     */
+    template <typename F>
+    bool scan(F visit) const {
+        const Node *n = follow(sb->list_head);
+        bool first = true;
+        decltype(Node::key) last{};
+        while (n != nullptr) {
+            uint64_t raw = __atomic_load_n((const uint64_t *)&n->next, __ATOMIC_ACQUIRE);
+            if (raw == 0)
+                return true;
+            n = follow(raw);
+            if (n == nullptr || (!first && !(last < n->key)))
+                return false;
+            last = n->key;
+            first = false;
+            if (!__atomic_load_n(&n->isDelete, __ATOMIC_ACQUIRE) && !dead(n))
+                visit(n->key, n->value);
+        }
+        return false;
+    }
+};
+
+}  // namespace attach
@@ -0,0 +1,282 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <functional>
+#include <random>
+#include <vector>
+
+/*
+ * Helpers for repeatable measurements: warmup and repetitions around a timed
+ * body, median with a 95% confidence interval, and a small JSON writer so runs
+ * can be compared by scripts instead of by reading printf output.
+ */
+namespace bench {
+
+constexpr int TIMELINE_INTERVAL_MS = 100;
+
+struct summary {
+    double median = 0;
+    double ci_low = 0;          // 95% confidence interval of the median
+    double ci_high = 0;
+    std::vector<double> samples;
+};
+
+/*
+ * Median and a distribution-free 95% CI from order statistics: ranks
+ * n/2 -+ 1.96 * sqrt(n) / 2, clamped to the samples (min/max below n = 6).
+ */
+inline summary summarize(std::vector<double> samples) {
+    summary s;
+    s.samples = samples;
+    if (samples.empty())
+        return s;
+    std::sort(samples.begin(), samples.end());
+    size_t n = samples.size();
+    s.median = n % 2 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+    double half = 1.96 * std::sqrt((double)n) / 2;
+    long lo = (long)std::floor(n / 2.0 - half);
+    long hi = (long)std::ceil(n / 2.0 + half) - 1;
+    s.ci_low = samples[std::max(lo, 0L)];
+    s.ci_high = samples[std::min(hi, (long)n - 1)];
+    return s;
+}
+
+inline int64_t elapsed_ns(std::function<void()> f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+}
+
+// ns per op of a repeatable body, after warmup untimed runs.
+inline summary measure(int warmup, int repetitions, size_t ops, std::function<void()> f) {
+    for (int i = 0; i < warmup; ++i)
+        f();
+    std::vector<double> samples;
+    for (int i = 0; i < repetitions; ++i)
+        samples.push_back(elapsed_ns(f) / (double)ops);
+    return summarize(samples);
+}
+
+/*
+ * ns per op of a body that changes state (e.g. inserts) and so cannot be
+ * repeated: [0, ops) is cut into repetitions slices and each slice is a sample.
+ */
+inline summary measure_slices(int repetitions, size_t ops, std::function<void(size_t, size_t)> f) {
+    std::vector<double> samples;
+    for (int i = 0; i < repetitions; ++i) {
+        size_t begin = ops * i / repetitions, end = ops * (i + 1) / repetitions;
+        samples.push_back(elapsed_ns([&]() { f(begin, end); }) / (double)(end - begin));
+    }
+    return summarize(samples);
+}
+
+inline uint64_t now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+/*
+ * Log-linear latency histogram: exact below 64 ns, above that 32 buckets per
+ * power of two (at most ~3% error). Small enough to keep one per thread.
+ */
+class histogram {
+    constexpr static int SUB_BITS = 6;
+    constexpr static int HALF = 1 << (SUB_BITS - 1);
+    constexpr static int BUCKETS = (64 - SUB_BITS + 2) * HALF;
+
+    uint64_t counts[BUCKETS];
+    uint64_t total;
+
+    static int index(uint64_t v) {
+        if (v < 2 * HALF)
+            return (int)v;
+        int e = 63 - __builtin_clzll(v) - (SUB_BITS - 1);
+        return e * HALF + (int)(v >> e);
+    }
+
+    static uint64_t lowest(int i) {
+        if (i < 2 * HALF)
+            return i;
+        int e = i / HALF - 1;
+        return (uint64_t)(i - e * HALF) << e;
+    }
+
+public:
+    histogram() { clear(); }
+
+    void clear() {
+        std::fill(counts, counts + BUCKETS, 0);
+        total = 0;
+    }
+
+    void add(uint64_t ns) {
+        ++counts[index(ns)];
+        ++total;
+    }
+
+    void merge(const histogram &other) {
+        for (int i = 0; i < BUCKETS; ++i)
+            counts[i] += other.counts[i];
+        total += other.total;
+    }
+
+    uint64_t count() const { return total; }
+
+    // Upper edge of the bucket holding the p-quantile, in ns.
+    uint64_t percentile(double p) const {
+        uint64_t target = std::max<uint64_t>(1, (uint64_t)std::ceil(p * total));
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; ++i) {
+            seen += counts[i];
+            if (seen >= target)
+                return i + 1 < BUCKETS ? lowest(i + 1) - 1 : UINT64_MAX;
+        }
+        return 0;
+    }
+};
+
+/*
+ * Intended start times of an open-loop load at a fixed rate, either evenly
+ * spaced or with exponential gaps (Poisson arrivals). Latency measured from
+ * these times includes the time an op waited behind a slow predecessor.
+ */
+class arrival_schedule {
+    double gap_ns;
+    bool poisson;
+    std::mt19937_64 rng;
+    std::exponential_distribution<double> exp_gap;
+    double next_ns;
+
+public:
+    arrival_schedule(double ops_per_sec, bool poisson, uint64_t seed, uint64_t start_ns)
+            : gap_ns(1e9 / ops_per_sec), poisson(poisson), rng(seed),
+              exp_gap(1.0 / gap_ns), next_ns((double)start_ns) {}
+
+    uint64_t next() {
+        uint64_t ret = (uint64_t)next_ns;
+        next_ns += poisson ? exp_gap(rng) : gap_ns;
+        return ret;
+    }
+};
+
+// Wait for t (ns, CLOCK_MONOTONIC) without oversleeping, or until stop is set.
+inline void wait_until(uint64_t t, volatile const size_t &stop) {
+    uint64_t now = now_ns();
+    if (t > now + 100000) {     // far away: sleep most of it
+        uint64_t d = t - now - 50000;
+        struct timespec ts = {(time_t)(d / 1000000000ULL), (long)(d % 1000000000ULL)};
+        nanosleep(&ts, nullptr);
+    }
+    while (now_ns() < t && !stop)
+        ;
+}
+
+/*
+ * Minimal streaming JSON writer. Keys and values are written in call order,
+ * commas are inserted as needed.
+ */
+class json {
+    FILE *out;
+    std::vector<bool> first;    // per open object/array: nothing written yet
+    bool after_key = false;
+
+    void sep() {
+        if (after_key) {
+            after_key = false;
+        } else if (!first.empty()) {
+            if (!first.back())
+                fputc(',', out);
+            first.back() = false;
+        }
+    }
+
+    json &open(char c) {
+        sep();
+        fputc(c, out);
+        first.push_back(true);
+        return *this;
+    }
+
+    json &close(char c) {
+        first.pop_back();
+        fputc(c, out);
+        return *this;
+    }
+
+public:
+    explicit json(FILE *out) : out(out) {}
+
+    json &key(const char *k) {
+        sep();
+        fprintf(out, "\"%s\":", k);
+        after_key = true;
+        return *this;
+    }
+
+    json &begin_object() { return open('{'); }
+    json &end_object() { return close('}'); }
+    json &begin_array() { return open('['); }
+    json &end_array() { return close(']'); }
+
+    json &value(double v) {
+        sep();
+        if (std::isfinite(v))
+            fprintf(out, "%.6g", v);
+        else
+            fputs("null", out);
+        return *this;
+    }
+
+    json &value(long v) {
+        sep();
+        fprintf(out, "%ld", v);
+        return *this;
+    }
+
+    json &value(int v) { return value((long)v); }
+    json &value(unsigned long v) { return value((long)v); }
+
+    json &value(const char *v) {
+        sep();
+        fputc('"', out);
+        for (; *v; ++v) {
+            if (*v == '"' || *v == '\\')
+                fputc('\\', out);
+            fputc(*v, out);
+        }
+        fputc('"', out);
+        return *this;
+    }
+
+    json &value(const summary &s) {
+        begin_object();
+        key("median").value(s.median);
+        key("ci95").begin_array().value(s.ci_low).value(s.ci_high).end_array();
+        key("samples").begin_array();
+        for (double x : s.samples)
+            value(x);
+        end_array();
+        return end_object();
+    }
+
+    json &value(const std::vector<double> &v) {
+        begin_array();
+        for (double x : v)
+            value(x);
+        return end_array();
+    }
+
+    template <typename V>
+    json &field(const char *k, const V &v) {
+        return key(k).value(v);
+    }
+};
+
+} // namespace bench
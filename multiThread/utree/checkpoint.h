@@ -0,0 +1,147 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/*
+ * File image of the DRAM pages, written by btree::checkpoint() and mapped by
+ * the restarting constructor. Pages are numbered in the order they are
+ * written, level by level from the root down and left to right within a
+ * level, and refer to each other by number; leaf entries hold the offset of
+ * their list node from the image's PM base, or its pm::rel_ptr bits in a
+ * RELATIVE image. Only the entries in use are stored.
+ */
+namespace checkpoint {
+
+constexpr uint64_t MAGIC = 0x314b434545525475ULL;  // "uTREECK1"
+constexpr uint32_t NONE = UINT32_MAX;
+
+enum : uint32_t {
+    EXACT = 1,     // taken with no writer running: pages and list agree
+    RELATIVE = 2,  // references are pool relative, pm_base is not used
+};
+
+// Persistent, allocated with the list head.
+struct meta {
+    std::atomic<uint64_t> epoch;    // of the last checkpoint begun
+    std::atomic<uint64_t> written;  // last epoch a write began in
+    int64_t delta_log;              // reference to the delta buffer's log, 0 without one
+};
+
+struct image_header {
+    uint64_t magic;
+    uint32_t key_bytes;
+    uint32_t flags;
+    uint64_t epoch;
+    uint64_t pm_base;       // where the offsets below were taken from
+    int64_t list_head;
+    int64_t meta;
+    uint32_t height;
+    uint32_t pages;
+    uint64_t bytes;         // of the whole image
+};
+
+struct page_header {
+    uint32_t level;
+    uint32_t count;
+    uint32_t leftmost;      // page number, NONE in leaves
+    uint32_t sibling;
+};
+
+template <typename K>
+struct record {
+    K key;
+    int64_t ref;            // page number in inner pages, list node offset in leaves
+};
+
+template <typename K>
+class writer {
+    std::vector<char> buf;
+
+    template <typename S>
+    void put(const S &s) {
+        buf.insert(buf.end(), (const char *)&s, (const char *)&s + sizeof(S));
+    }
+
+public:
+    writer() { buf.resize(sizeof(image_header)); }
+
+    void page(const page_header &h, const record<K> *records) {
+        put(h);
+        buf.insert(buf.end(), (const char *)records, (const char *)(records + h.count));
+    }
+
+    // Written next to path and renamed over it, a crash leaves the old image.
+    bool commit(const std::string &path, image_header h) {
+        h.magic = MAGIC;
+        h.key_bytes = sizeof(K);
+        h.bytes = buf.size();
+        memcpy(buf.data(), &h, sizeof(h));
+        auto tmp = path + ".tmp";
+        FILE *f = fopen(tmp.c_str(), "wb");
+        if (f == nullptr)
+            return false;
+        bool ok = fwrite(buf.data(), 1, buf.size(), f) == buf.size() && fflush(f) == 0 &&
+                  fsync(fileno(f)) == 0;
+        ok = fclose(f) == 0 && ok;
+        return ok && rename(tmp.c_str(), path.c_str()) == 0;
+    }
+};
+
+template <typename K>
+class image {
+    char *base = nullptr;
+    size_t size = 0;
+    std::vector<const page_header *> index;
+
+public:
+    // Maps path and checks it, valid() is false if it is missing or damaged.
+    explicit image(const char *path) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(image_header)) {
+            size = st.st_size;
+            void *m = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            base = m == MAP_FAILED ? nullptr : (char *)m;
+        }
+        close(fd);
+        if (base == nullptr)
+            return;
+        auto &h = header();
+        if (h.magic != MAGIC || h.key_bytes != sizeof(K) || h.bytes != size)
+            return;
+        size_t off = sizeof(image_header);
+        for (uint32_t i = 0; i < h.pages; ++i) {
+            if (off + sizeof(page_header) > size)
+                return;
+            auto p = (const page_header *)(base + off);
+            off += sizeof(page_header) + (size_t)p->count * sizeof(record<K>);
+            if (off > size)
+                return;
+            index.push_back(p);
+        }
+    }
+
+    ~image() {
+        if (base != nullptr)
+            munmap(base, size);
+    }
+
+    bool valid() const { return base != nullptr && index.size() == header().pages && index.size() > 0; }
+    const image_header &header() const { return *(const image_header *)base; }
+    const page_header &page(uint32_t i) const { return *index[i]; }
+    const record<K> *records(uint32_t i) const { return (const record<K> *)(index[i] + 1); }
+};
+
+}  // namespace checkpoint
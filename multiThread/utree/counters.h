@@ -0,0 +1,141 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+/*
+ * Per-thread event counters. Each thread bumps its own cache line without
+ * atomics, snapshot() sums them up (and what exited threads left behind).
+ * Build with -DNO_UTREE_COUNTERS to compile the increments out.
+ */
+namespace counters {
+
+enum id : int {
+    INSERT_RETRY_IS_UPDATE,     // predecessor list node was being updated
+    INSERT_RETRY_CAS,           // CAS on the predecessor's next failed
+    INSERT_RETRY_VIEW,          // predecessor/successor no longer bracket the key
+    INSERT_GAVE_UP,             // insert returned nullptr
+    INSERT_MAX_RETRIES,         // most retries a single insert needed
+    REMOVE_RETRY,
+    VERSION_REREAD,             // a page read was redone because switch_counter moved
+    SIBLING_HOP,                // a search or store moved right along sibling_ptr
+    LEAF_SPLIT,
+    INNER_SPLIT,
+    ROOT_GROWTH,
+    FLUSH,                      // clflush() calls
+    FLUSH_LINES,
+    FC_COMBINED,                // inserts applied on behalf of another thread
+    FC_DECLINED,
+    SPLIT_DEFERRED,             // separators handed to the split maintainer
+    SPLIT_INLINE_FALLBACK,      // split queue was full
+    DELTA_MERGED,               // buffered entries merged into the tree
+    FINGER_HIT,                 // an op started at the thread's last leaf
+    FINGER_MISS,                // the last leaf did not cover the key, descended from root
+    COMPACT_LEAVES,             // leaves whose list nodes the compactor moved
+    COMPACT_BYTES,
+    COMPACT_ABORTED,            // the leaf's run was not linked as expected, left alone
+    NUM
+};
+
+const char *const names[NUM] = {
+    "insert_retry_is_update", "insert_retry_cas", "insert_retry_view",
+    "insert_gave_up", "insert_max_retries", "remove_retry", "version_reread",
+    "sibling_hop", "leaf_split", "inner_split", "root_growth", "flush",
+    "flush_lines", "fc_combined", "fc_declined", "split_deferred",
+    "split_inline_fallback", "delta_merged", "finger_hit", "finger_miss",
+    "compact_leaves", "compact_bytes", "compact_aborted",
+};
+
+inline bool is_max(int i) {
+    return i == INSERT_MAX_RETRIES;
+}
+
+using values = std::array<uint64_t, NUM>;
+
+struct alignas(64) block {
+    std::atomic<uint64_t> v[NUM];
+};
+
+inline std::mutex registry_mtx;
+inline std::vector<block *> live;
+inline values exited{};
+
+inline void fold(values &into, const block &b) {
+    for (int i = 0; i < NUM; ++i) {
+        uint64_t x = b.v[i].load(std::memory_order_relaxed);
+        into[i] = is_max(i) ? std::max(into[i], x) : into[i] + x;
+    }
+}
+
+struct registration {
+    block b;
+
+    registration() {
+        for (auto &x : b.v)
+            x.store(0, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(registry_mtx);
+        live.push_back(&b);
+    }
+
+    ~registration() {
+        std::lock_guard<std::mutex> lock(registry_mtx);
+        fold(exited, b);
+        live.erase(std::find(live.begin(), live.end(), &b));
+    }
+};
+
+inline block &mine() {
+    static thread_local registration r;
+    return r.b;
+}
+
+inline void add(id i, uint64_t n = 1) {
+#ifndef NO_UTREE_COUNTERS
+    auto &c = mine().v[i];
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+#endif
+}
+
+inline void max(id i, uint64_t n) {
+#ifndef NO_UTREE_COUNTERS
+    auto &c = mine().v[i];
+    if (n > c.load(std::memory_order_relaxed))
+        c.store(n, std::memory_order_relaxed);
+#endif
+}
+
+// The calling thread's own counters.
+inline values local() {
+    values ret{};
+    fold(ret, mine());
+    return ret;
+}
+
+// Totals over all threads, past and present.
+inline values snapshot() {
+    std::lock_guard<std::mutex> lock(registry_mtx);
+    values ret = exited;
+    for (auto b : live)
+        fold(ret, *b);
+    return ret;
+}
+
+// Difference of two snapshots, for counting over one phase.
+inline values since(const values &before, const values &after) {
+    values ret{};
+    for (int i = 0; i < NUM; ++i)
+        ret[i] = is_max(i) ? after[i] : after[i] - before[i];
+    return ret;
+}
+
+inline void print(const values &v, FILE *out = stdout) {
+    for (int i = 0; i < NUM; ++i)
+        fprintf(out, "  %-24s: %lu\n", names[i], (unsigned long)v[i]);
+}
+
+} // namespace counters
@@ -0,0 +1,296 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * DRAM write buffer in front of the tree. Writes land in a sorted map per
+ * partition and in a small persistent redo log, and are merged into the tree
+ * in key order by a background thread (or by a writer whose log is full).
+ * Included by utree.h after clflush() is defined.
+ */
+template <typename Key, typename Value>
+class delta_buffer {
+public:
+    constexpr static size_t PARTITIONS = 16;
+    constexpr static size_t LOG_ENTRIES = 4096;            // per log segment
+    constexpr static size_t MERGE_THRESHOLD = LOG_ENTRIES / 2;
+    constexpr static int MERGE_INTERVAL_MS = 10;
+
+    struct pending {
+        Value value;
+        bool deleted;
+    };
+    using apply_fn = std::function<void(const Key &, const pending &)>;
+
+private:
+    struct log_record {
+        uint64_t gen;
+        uint64_t seq;
+        Key key;
+        Value value;
+        uint64_t deleted;
+        uint64_t checksum;
+    };
+
+    struct log_segment {
+        uint64_t gen;
+        char pad[CACHE_LINE_SIZE - sizeof(uint64_t)];
+        log_record records[LOG_ENTRIES];
+    };
+
+    struct alignas(CACHE_LINE_SIZE) partition {
+        std::mutex mtx;                 // protects active, frozen and the log cursor
+        std::mutex merge_mtx;           // one merge per partition at a time
+        std::map<Key, pending> active;
+        std::map<Key, pending> frozen;  // being merged, read-only until cleared
+        std::atomic<size_t> pending_count{0};
+        log_segment *logs[2];
+        int active_log = 0;
+        size_t log_used = 0;
+        uint64_t seq = 0;
+    };
+
+    partition parts[PARTITIONS];
+    apply_fn apply;
+    std::thread merger;
+    std::mutex merger_mtx;
+    std::condition_variable merger_cv;
+    bool stop = false;
+
+    static uint64_t checksum(const log_record *r) {
+        auto bytes = reinterpret_cast<const unsigned char *>(r);
+        uint64_t h = 14695981039346656037ULL;
+        for (size_t i = 0; i < offsetof(log_record, checksum); ++i) {
+            h ^= bytes[i];
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    partition &partition_of(const Key &key) {
+        uint64_t h = 0;
+        for (auto w : key)
+            h = h * 31 + w;
+        return parts[(h ^ (h >> 17)) % PARTITIONS];
+    }
+
+    void append_log(partition &p, const Key &key, const pending &e) {
+        log_segment *seg = p.logs[p.active_log];
+        log_record *r = &seg->records[p.log_used++];
+        r->gen = seg->gen;
+        r->seq = ++p.seq;
+        r->key = key;
+        r->value = e.value;
+        r->deleted = e.deleted;
+        r->checksum = checksum(r);
+        clflush((char *)r, sizeof(log_record));
+    }
+
+    // Invalidate every record of a segment by bumping its generation.
+    static void truncate(log_segment *seg) {
+        ++seg->gen;
+        clflush((char *)&seg->gen, sizeof(uint64_t));
+    }
+
+    void merge(partition &p) {
+        std::lock_guard<std::mutex> merge_lock(p.merge_mtx);
+        log_segment *seg;
+        {
+            std::lock_guard<std::mutex> lock(p.mtx);
+            if (p.active.empty())
+                return;
+            p.frozen.swap(p.active);
+            seg = p.logs[p.active_log];
+            p.active_log ^= 1;
+            p.log_used = 0;
+        }
+        for (auto &kv : p.frozen)
+            apply(kv.first, kv.second);
+        {
+            std::lock_guard<std::mutex> lock(p.mtx);
+            p.pending_count -= p.frozen.size();
+            p.frozen.clear();
+        }
+        truncate(seg);
+    }
+
+    void merger_loop(std::function<void()> init) {
+        init();
+        std::unique_lock<std::mutex> lock(merger_mtx);
+        while (!stop) {
+            merger_cv.wait_for(lock, std::chrono::milliseconds(MERGE_INTERVAL_MS));
+            lock.unlock();
+            for (auto &p : parts)
+                merge(p);
+            lock.lock();
+        }
+    }
+
+public:
+    /*
+     * region must hold region_size() bytes of zeroed persistent memory, or
+     * with restart the region of a buffer that ran before a crash, whose
+     * records are replayed first. init runs on the merger thread before its
+     * first merge (e.g. to give it its own allocation space), apply writes
+     * one buffered entry into the tree.
+     */
+    delta_buffer(char *region, apply_fn apply, std::function<void()> init, bool restart = false)
+            : apply(apply) {
+        if (restart)
+            replay(region);
+        for (auto &p : parts) {
+            p.logs[0] = reinterpret_cast<log_segment *>(region);
+            p.logs[1] = p.logs[0] + 1;
+            region += 2 * sizeof(log_segment);
+            for (auto seg : p.logs) {
+                if (restart) {
+                    truncate(seg);
+                } else {
+                    seg->gen = 1;
+                    clflush((char *)seg, CACHE_LINE_SIZE);
+                }
+            }
+        }
+        merger = std::thread(&delta_buffer::merger_loop, this, init);
+    }
+
+    ~delta_buffer() {
+        {
+            std::lock_guard<std::mutex> lock(merger_mtx);
+            stop = true;
+        }
+        merger_cv.notify_one();
+        merger.join();
+        flush();
+    }
+
+    static size_t region_size() {
+        return PARTITIONS * 2 * sizeof(log_segment) + CACHE_LINE_SIZE;
+    }
+
+    void put(const Key &key, const Value &value, bool deleted = false) {
+        auto &p = partition_of(key);
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock(p.mtx);
+                if (p.log_used < LOG_ENTRIES) {
+                    pending e{value, deleted};
+                    append_log(p, key, e);
+                    auto it = p.active.find(key);
+                    if (it == p.active.end()) {
+                        p.active.emplace(key, e);
+                        ++p.pending_count;
+                    } else {
+                        it->second = e;
+                    }
+                    if (p.active.size() == MERGE_THRESHOLD)
+                        merger_cv.notify_one();
+                    return;
+                }
+            }
+            merge(p);   // log segment full: merge in the foreground
+        }
+    }
+
+    // Latest buffered state of key, false if the buffer holds nothing for it.
+    bool get(const Key &key, pending &out) {
+        auto &p = partition_of(key);
+        if (p.pending_count.load() == 0)
+            return false;
+        std::lock_guard<std::mutex> lock(p.mtx);
+        auto it = p.active.find(key);
+        if (it != p.active.end()) {
+            out = it->second;
+            return true;
+        }
+        it = p.frozen.find(key);
+        if (it != p.frozen.end()) {
+            out = it->second;
+            return true;
+        }
+        return false;
+    }
+
+    // Merge key's partition now if it holds key, so the tree is up to date for it.
+    void drain(const Key &key) {
+        pending e;
+        if (get(key, e))
+            merge(partition_of(key));
+    }
+
+    /*
+     * Buffered entries with key >= from in key order, up to n that are not
+     * deletes. A partition's frozen and active maps are merged before they are
+     * cut off, a delete in one can hide an entry of the other.
+     */
+    std::vector<std::pair<Key, pending>> range(const Key &from, size_t n) {
+        std::map<Key, pending> out;
+        for (auto &p : parts) {
+            if (p.pending_count.load() == 0)
+                continue;
+            std::lock_guard<std::mutex> lock(p.mtx);
+            auto f = p.frozen.lower_bound(from), a = p.active.lower_bound(from);
+            size_t live = 0;
+            while (live < n && (f != p.frozen.end() || a != p.active.end())) {
+                // the lower key next, the active entry if both hold it
+                typename std::map<Key, pending>::iterator e;
+                if (a == p.active.end() || (f != p.frozen.end() && f->first < a->first)) {
+                    e = f++;
+                } else {
+                    if (f != p.frozen.end() && !(a->first < f->first))
+                        ++f;
+                    e = a++;
+                }
+                out.insert(*e);
+                live += !e->second.deleted;
+            }
+        }
+        std::vector<std::pair<Key, pending>> ret;
+        size_t live = 0;
+        for (auto &kv : out) {
+            if (live == n)
+                break;
+            ret.push_back(kv);
+            live += !kv.second.deleted;
+        }
+        return ret;
+    }
+
+    void flush() {
+        for (auto &p : parts)
+            merge(p);
+    }
+
+private:
+    /*
+     * Apply every valid record of the region, a key's in the order they were
+     * written. Those of a merge that was running are applied again, which
+     * leaves the same state; the constructor truncates the segments after, so
+     * a crash before that replays them all once more.
+     */
+    void replay(char *region) {
+        std::vector<log_record *> records;
+        auto seg = reinterpret_cast<log_segment *>(region);
+        for (size_t i = 0; i < PARTITIONS * 2; ++i, ++seg) {
+            for (auto &r : seg->records) {
+                if (r.gen != seg->gen || r.checksum != checksum(&r))
+                    break;
+                records.push_back(&r);
+            }
+        }
+        std::stable_sort(records.begin(), records.end(), [](log_record *a, log_record *b) {
+            return a->seq < b->seq;
+        });
+        for (auto r : records)
+            apply(r->key, {r->value, r->deleted != 0});
+    }
+};
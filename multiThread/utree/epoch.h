@@ -0,0 +1,147 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Epoch-based reclamation for the DRAM structures that are read without locks.
+ * A reader brackets its accesses with an epoch_guard, a writer that unlinks an
+ * object hands it to retire() and it is freed once no reader can still see it.
+ */
+namespace epoch {
+
+constexpr int MAX_THREADS = 512;
+constexpr size_t COLLECT_THRESHOLD = 64;
+
+struct retired {
+    void *ptr;
+    void (*deleter)(void *);
+    uint64_t epoch;
+};
+
+struct alignas(64) thread_slot {
+    std::atomic<uint64_t> local{0};     // 0 = quiescent
+    std::atomic<bool> in_use{false};
+    int depth = 0;
+    std::vector<retired> limbo;
+};
+
+inline std::atomic<uint64_t> global_epoch{1};
+inline thread_slot slots[MAX_THREADS];
+inline std::mutex orphan_mtx;
+inline std::vector<retired> orphans;
+
+struct registration {
+    int id = -1;
+
+    registration() {
+        for (int i = 0; i < MAX_THREADS; ++i) {
+            bool expected = false;
+            if (slots[i].in_use.compare_exchange_strong(expected, true)) {
+                id = i;
+                return;
+            }
+        }
+        printf("epoch: more than %d threads registered\n", MAX_THREADS);
+        std::exit(0);
+    }
+
+    ~registration() {
+        // The limbo outlives the thread, whoever collects next frees it.
+        std::lock_guard<std::mutex> lock(orphan_mtx);
+        orphans.insert(orphans.end(), slots[id].limbo.begin(), slots[id].limbo.end());
+        slots[id].limbo.clear();
+        slots[id].in_use.store(false);
+    }
+};
+
+inline thread_slot &my_slot() {
+    static thread_local registration r;
+    return slots[r.id];
+}
+
+inline void enter() {
+    auto &s = my_slot();
+    if (s.depth++ == 0)
+        s.local.store(global_epoch.load());
+}
+
+inline void leave() {
+    auto &s = my_slot();
+    if (--s.depth == 0)
+        s.local.store(0, std::memory_order_release);
+}
+
+// Smallest epoch a reader is still running in, or UINT64_MAX if none is.
+inline uint64_t min_active() {
+    uint64_t min = UINT64_MAX;
+    for (auto &s : slots) {
+        uint64_t e = s.local.load();
+        if (e != 0 && e < min)
+            min = e;
+    }
+    return min;
+}
+
+/*
+ * Wait until every thread that was inside a guard when this was called has
+ * left it. Guards entered afterwards are not waited for, so a writer that
+ * brackets "check a flag, then act" with a guard either sees a flag set before
+ * the call or has acted by the time this returns.
+ */
+inline void synchronize() {
+    uint64_t e = global_epoch.fetch_add(1) + 1;
+    for (auto &s : slots) {
+        uint64_t l;
+        while ((l = s.local.load()) != 0 && l < e)
+            std::this_thread::yield();
+    }
+}
+
+inline void free_expired(std::vector<retired> &list, uint64_t min) {
+    size_t kept = 0;
+    for (auto &r : list) {
+        if (r.epoch < min)
+            r.deleter(r.ptr);
+        else
+            list[kept++] = r;
+    }
+    list.resize(kept);
+}
+
+inline void collect() {
+    global_epoch.fetch_add(1);
+    uint64_t min = min_active();
+    free_expired(my_slot().limbo, min);
+    std::unique_lock<std::mutex> lock(orphan_mtx, std::try_to_lock);
+    if (lock.owns_lock())
+        free_expired(orphans, min);
+}
+
+template <typename T>
+void retire(T *ptr) {
+    auto &s = my_slot();
+    s.limbo.push_back({ptr, [](void *p) { delete static_cast<T *>(p); },
+                       global_epoch.load()});
+    if (s.limbo.size() >= COLLECT_THRESHOLD)
+        collect();
+}
+
+inline void retire(void *ptr, void (*deleter)(void *)) {
+    auto &s = my_slot();
+    s.limbo.push_back({ptr, deleter, global_epoch.load()});
+    if (s.limbo.size() >= COLLECT_THRESHOLD)
+        collect();
+}
+
+struct guard {
+    guard() { enter(); }
+    ~guard() { leave(); }
+};
+
+} // namespace epoch
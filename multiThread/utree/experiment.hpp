@@ -5,10 +5,16 @@
 #include <unordered_set>
 #include <typeinfo>
 #include <map>
+#include <utility>
+#include <tuple>
+#include <type_traits>
 
-#include "utree.h"
+#include "table.h"
+#include "bench.h"
+#include "perf_counters.h"
+#include "key_encoding.h"
 
-const size_t padding_size = 64;
+const size_t default_padding_size = 64;
 std::uniform_int_distribution<uint64_t> data_dist(0, 100'000'000ull);
 std::mt19937 rng;
 
@@ -42,63 +48,95 @@ void randomize(std::array<uint64_t, S> & array)
     }
 }
 
+template <size_t S>
+void randomize(normalized_key<S> & key)
+{
+    std::array<uint64_t, S> words;
+    randomize(words);
+    key = normalized_key<S>::from_words(words);
+}
+
+template <size_t KeyWords, size_t PaddingWords = default_padding_size,
+          typename KeyType = std::array<uint64_t, KeyWords>>
 struct Data {
+    using key_type = KeyType;
 
-    entry_key_t primary;
-    entry_key_t secondary;
+    key_type primary;
+    key_type secondary;
     // just to increase size
-    std::array<uint64_t, padding_size> padding;
+    std::array<uint64_t, PaddingWords> padding;
 };
 
-int64_t time(std::function<void()> f)
+const int warmup_runs = 1;
+const int repetitions = 5;
+
+
+void print_experiment_header()
 {
-    sleep(1);
-    auto start = std::chrono::high_resolution_clock::now();
-    f();
-    auto end = std::chrono::high_resolution_clock::now();
-    return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    std::cout << "Times in ns (median of " << repetitions << " runs), storage in bytes" << std::endl;
+    std::cout
+        << "Key Size, Row Size, "
+        << "Insert, "
+        << "Primary search hit, Secondary search hit, Primary search miss, Secondary search miss, "
+        << "Primary (DRAM), Secondary (DRAM), Primary (NVRAM), Secondary (NVRAM),"
+        << "PrimaryScan10, PrimaryScan100, PrimaryScan1000,"
+        << "SecondaryScan10, SecondaryScan100, SecondaryScan1000,"
+        << "Key Encoding,"
+        << std::endl;
 }
 
-
-void experiment()
+/*
+ * Normalized: byte-comparable keys (key_encoding.h) instead of word arrays.
+ * The rows go into a table (table.h) with an index on the secondary column,
+ * so an insert writes the row and both indexes.
+ */
+template <size_t KeyWords, size_t PaddingWords, bool Normalized = false>
+void experiment(FILE *json)
 {
-    btree<Data> primary;
-    btree<Data*> secondary;
+    using Row = Data<KeyWords, PaddingWords,
+                     std::conditional_t<Normalized, normalized_key<KeyWords>, std::array<uint64_t, KeyWords>>>;
+    using Key = typename Row::key_type;
+
+    table<Row, table_index::column<&Row::primary>, table_index::column<&Row::secondary>> rows;
+    auto & primary = rows.primary();
+    auto & secondary = rows.template index<0>();
 
-    std::vector<std::pair<Data, Data *>> data;
-    std::unordered_set<entry_key_t> primary_set;
-    std::unordered_set<entry_key_t> secondary_set;
-    std::vector<entry_key_t> primary_keys;
-    std::vector<entry_key_t> secondary_keys;
+    std::vector<Row> data;
+    std::unordered_set<Key> primary_set;
+    std::unordered_set<Key> secondary_set;
+    std::vector<Key> primary_keys;
+    std::vector<Key> secondary_keys;
+    // secondary keys are unique in a table too
     while (data.size() < 2'000'000)
     {
-        Data d;
+        Row d;
         randomize(d.primary);
         randomize(d.secondary);
         randomize(d.padding);
-        if (primary_set.find(d.primary) == primary_set.end())
+        if (primary_set.find(d.primary) == primary_set.end() &&
+            secondary_set.find(d.secondary) == secondary_set.end())
         {
             primary_set.insert(d.primary);
             secondary_set.insert(d.secondary);
-            data.push_back({d, nullptr});
+            data.push_back(d);
             primary_keys.push_back(d.primary);
             secondary_keys.push_back(d.secondary);
         }
     }
-    std::vector<entry_key_t> not_present_primary;
+    std::vector<Key> not_present_primary;
     while (not_present_primary.size() < 1'000'000)
     {
-        entry_key_t key;
+        Key key;
         randomize(key);
         if (primary_set.find(key) == primary_set.end())
         {
             not_present_primary.push_back(key);
         }
     }
-    std::vector<entry_key_t> not_present_secondary;
+    std::vector<Key> not_present_secondary;
     while (not_present_secondary.size() < 1'000'000)
     {
-        entry_key_t key;
+        Key key;
         randomize(key);
         if (secondary_set.find(key) == secondary_set.end())
         {
@@ -106,20 +144,26 @@ void experiment()
         }
     }
 
-    const auto primary_insert_time = time([&](){
-        for (auto & [el, loc] : data)
-        {
-            auto inserted = primary.insert(el.primary, el);
-            loc = inserted;
-        }
-    }) / static_cast<float>(data.size());
+    // hardware counters per op of each phase, warmup passes included
+    perf::group pmu;
+    std::vector<std::pair<std::string, perf::values>> phase_perf;
+    auto counted = [&](const std::string & phase, size_t ops, std::function<bench::summary()> measure_phase){
+        pmu.start();
+        auto ret = measure_phase();
+        phase_perf.emplace_back(phase, pmu.stop().per_op(ops));
+        return ret;
+    };
 
-    const auto secondary_insert_time = time([&](){
-        for (const auto & [el, loc] : data)
-        {
-            secondary.insert(el.secondary, loc);
-        }
-    }) / static_cast<float>(data.size());
+    // inserts cannot be repeated, each slice of the data is one sample
+    const auto insert = counted("insert", data.size(), [&](){
+        return bench::measure_slices(repetitions, data.size(), [&](size_t begin, size_t end){
+            for (size_t i = begin; i < end; ++i)
+            {
+                auto inserted = rows.insert(data[i]);
+                assert(inserted);
+            }
+        });
+    });
 
 
     std::shuffle(primary_keys.begin(), primary_keys.end(), rng);
@@ -127,7 +171,7 @@ void experiment()
 
     const auto primary_dram = primary.getMemoryUsed();
     const auto secondary_dram = secondary.getMemoryUsed();
-    const auto primary_nvram = primary.getPersistentMemoryUsed();
+    const auto primary_nvram = primary.getPersistentMemoryUsed() + data.size() * sizeof(Row);
     const auto secondary_nvram = secondary.getPersistentMemoryUsed();
 
 
@@ -135,71 +179,349 @@ void experiment()
     int counter2 = 0;
     int repeats = 1'000'000;
 
-    const auto primary_hit = time([&](){
-        for (int i = 0; i < repeats; ++i)
-        {
-            auto ptr = primary.search(primary_keys[i]);
-            assert(ptr != nullptr);
-        }
-    }) / static_cast<float>(repeats);
+    const auto primary_hit = counted("primary_hit", (warmup_runs + repetitions) * repeats, [&](){
+        return bench::measure(warmup_runs, repetitions, repeats, [&](){
+            for (int i = 0; i < repeats; ++i)
+            {
+                auto ptr = rows.get(primary_keys[i]);
+                assert(ptr != nullptr);
+            }
+        });
+    });
 
-    const auto secondary_hit = time([&](){
-        for (int i = 0; i < repeats; ++i)
-        {
-            auto ptr = secondary.search(secondary_keys[i]);
-            assert(ptr != nullptr);
-        }
-    }) / static_cast<float>(repeats);
+    const auto secondary_hit = counted("secondary_hit", (warmup_runs + repetitions) * repeats, [&](){
+        return bench::measure(warmup_runs, repetitions, repeats, [&](){
+            for (int i = 0; i < repeats; ++i)
+            {
+                auto ptr = rows.template getBy<0>(secondary_keys[i]);
+                assert(ptr != nullptr);
+            }
+        });
+    });
 
-    const auto primary_miss = time([&](){
-        for (int i = 0; i < repeats; ++i)
+    const auto primary_miss = counted("primary_miss", (warmup_runs + repetitions) * repeats, [&](){
+        return bench::measure(warmup_runs, repetitions, repeats, [&](){
+            for (int i = 0; i < repeats; ++i)
+            {
+                auto ptr = rows.get(not_present_primary[i]);
+            }
+        });
+    });
+
+    const auto secondary_miss = counted("secondary_miss", (warmup_runs + repetitions) * repeats, [&](){
+        return bench::measure(warmup_runs, repetitions, repeats, [&](){
+            for (int i = 0; i < repeats; ++i)
+            {
+                auto ptr = rows.template getBy<0>(not_present_secondary[i]);
+            }
+        });
+    });
+
+    std::map<size_t, bench::summary> primary_scan;
+    std::map<size_t, bench::summary> secondary_scan;
+    for (auto width : {10, 100, 1000})
+    {
+        primary_scan[width] = counted("primary_scan" + std::to_string(width), (warmup_runs + repetitions) * (repeats / 10), [&](){
+            return bench::measure(warmup_runs, repetitions, repeats / 10, [&](){
+                for (int i = 0; i < repeats / 10; ++i)
+                {
+                    auto res = rows.scan(primary_keys[i], width);
+                }
+            });
+        });
+
+        secondary_scan[width] = counted("secondary_scan" + std::to_string(width), (warmup_runs + repetitions) * (repeats / 10), [&](){
+            return bench::measure(warmup_runs, repetitions, repeats / 10, [&](){
+                for (int i = 0; i < repeats / 10; ++i)
+                {
+                    auto res = rows.template scanBy<0>(secondary_keys[i], width);
+                }
+            });
+        });
+    }
+
+    std::cout
+        << sizeof(Key) << "," << sizeof(Row) << ","
+        << insert.median << ","
+        << primary_hit.median << "," << secondary_hit.median << ","
+        << primary_miss.median << "," << secondary_miss.median << ","
+        << primary_dram << "," << secondary_dram << "," << primary_nvram << "," << secondary_nvram << ","
+        << primary_scan[10].median << "," << primary_scan[100].median << "," << primary_scan[1000].median << ","
+        << secondary_scan[10].median << "," << secondary_scan[100].median << "," << secondary_scan[1000].median << ","
+        << (Normalized ? "normalized" : "array") << ","
+        << std::endl;
+
+    for (const auto & [phase, values] : phase_perf)
+    {
+        std::cout << "Hardware counters per op, " << phase << ":" << std::endl;
+        perf::print(values);
+    }
+
+    if (json != nullptr)
+    {
+        bench::json j(json);
+        j.begin_object();
+        j.key("config").begin_object()
+            .field("key_size", (int)sizeof(Key))
+            .field("row_size", (int)sizeof(Row))
+            .field("key_encoding", Normalized ? "normalized" : "array")
+            .field("rows", (int)data.size())
+            .field("repetitions", repetitions)
+            .end_object();
+        j.field("insert_ns", insert);
+        j.field("primary_hit_ns", primary_hit).field("secondary_hit_ns", secondary_hit);
+        j.field("primary_miss_ns", primary_miss).field("secondary_miss_ns", secondary_miss);
+        j.field("primary_dram_bytes", (unsigned long)primary_dram).field("secondary_dram_bytes", (unsigned long)secondary_dram);
+        j.field("primary_nvram_bytes", (unsigned long)primary_nvram).field("secondary_nvram_bytes", (unsigned long)secondary_nvram);
+        j.field("primary_scan10_ns", primary_scan[10]).field("primary_scan100_ns", primary_scan[100])
+         .field("primary_scan1000_ns", primary_scan[1000]);
+        j.field("secondary_scan10_ns", secondary_scan[10]).field("secondary_scan100_ns", secondary_scan[100])
+         .field("secondary_scan1000_ns", secondary_scan[1000]);
+        j.key("perf_per_op").begin_object();
+        for (const auto & [phase, values] : phase_perf)
         {
-            auto ptr = primary.search(not_present_primary[i]);
+            j.key(phase.c_str());
+            perf::write(j, values);
         }
-    }) / static_cast<float>(repeats);
+        j.end_object();
+        j.end_object();
+        fputc('\n', json);
+    }
+}
+
+
+/*
+ * Row layouts compiled into the binary: key words 1-32 and a few larger ones
+ * with the default padding, a padding sweep with one-word keys, and some key
+ * sizes again with normalized keys. One binary runs the whole sweep,
+ * experiment() is picked at runtime.
+ */
+enum key_encoding : int { ARRAY_KEYS, NORMALIZED_KEYS, ANY_ENCODING };
+
+using experiment_fn = void (*)(FILE *);
+using experiment_table = std::map<std::tuple<size_t, size_t, int>, experiment_fn>;
+
+template <size_t PaddingWords, bool Normalized, size_t... KeyWords>
+void register_encoded_experiments(experiment_table & table)
+{
+    (table.emplace(std::make_tuple(KeyWords, PaddingWords, Normalized ? NORMALIZED_KEYS : ARRAY_KEYS),
+                   &experiment<KeyWords, PaddingWords, Normalized>), ...);
+}
+
+template <size_t PaddingWords, size_t... KeyWords>
+void register_experiments(experiment_table & table)
+{
+    register_encoded_experiments<PaddingWords, false, KeyWords...>(table);
+}
+
+template <size_t PaddingWords, size_t... KeyWordsMinusOne>
+void register_experiments(experiment_table & table, std::index_sequence<KeyWordsMinusOne...>)
+{
+    register_experiments<PaddingWords, (KeyWordsMinusOne + 1)...>(table);
+}
 
-    const auto secondary_miss = time([&](){
+inline const experiment_table & experiments()
+{
+    static const experiment_table table = []() {
+        experiment_table t;
+        register_experiments<default_padding_size>(t, std::make_index_sequence<32>());
+        register_experiments<default_padding_size, 40, 48, 64, 80, 99>(t);
+        register_experiments<0, 1>(t);
+        register_experiments<8, 1>(t);
+        register_experiments<16, 1>(t);
+        register_experiments<32, 1>(t);
+        register_experiments<128, 1>(t);
+        register_experiments<256, 1>(t);
+        register_encoded_experiments<default_padding_size, true, 1, 2, 4, 8, 16, 32>(t);
+        return t;
+    }();
+    return table;
+}
+
+const size_t any_size = SIZE_MAX;
+
+/*
+ * Run the registered experiments matching key_words and padding_words (or
+ * any_size) and encoding. Each one reuses the calling thread's PM space, the
+ * previous trees are gone by then. Returns false if nothing matched.
+ */
+inline bool run_experiments(size_t key_words, size_t padding_words, int encoding = ARRAY_KEYS,
+                            FILE *json = nullptr)
+{
+    char *space = curr_addr;
+    bool found = false;
+    for (const auto & [layout, run] : experiments())
+    {
+        if ((key_words != any_size && std::get<0>(layout) != key_words) ||
+            (padding_words != any_size && std::get<1>(layout) != padding_words) ||
+            (encoding != ANY_ENCODING && std::get<2>(layout) != encoding))
+            continue;
+        if (!found)
+            print_experiment_header();
+        found = true;
+        curr_addr = space;
+        run(json);
+    }
+    if (!found)
+    {
+        std::cout << "no experiment compiled for " << key_words << " key words and "
+                  << padding_words << " padding words, available:";
+        for (const auto & entry : experiments())
+            std::cout << " " << std::get<0>(entry.first) << "/" << std::get<1>(entry.first)
+                      << (std::get<2>(entry.first) == NORMALIZED_KEYS ? "n" : "");
+        std::cout << std::endl;
+    }
+    return found;
+}
+
+
+/*
+ * Shadow list layouts side by side (list_layout.h), and the entry list under
+ * compact pages (page_layout.h): one tree of 8-byte values per layout over
+ * the same keys, single threaded, so the layouts differ in nothing but where
+ * the list or the pages keep a key.
+ */
+enum tree_layout : int { ENTRY_LIST, CHUNK_LIST, COMPACT_PAGES, ANY_LAYOUT };
+
+const char *layout_name(int layout)
+{
+    return layout == CHUNK_LIST ? "chunk_list" : layout == COMPACT_PAGES ? "compact_pages" : "entry_list";
+}
+
+void print_layout_header()
+{
+    std::cout << "Times in ns (median of " << repetitions << " runs), storage in bytes" << std::endl;
+    std::cout
+        << "Layout, Key Size, Insert, Search hit, Search miss, DRAM, NVRAM,"
+        << "Scan10, Scan100, Scan1000,"
+        << std::endl;
+}
+
+template <size_t KeyWords, typename L, typename P>
+void layout_experiment(int layout, FILE *json)
+{
+    using Key = std::array<uint64_t, KeyWords>;
+
+    btree<int64_t, Key, L, P> tree;
+
+    std::vector<Key> keys;
+    std::unordered_set<Key> present;
+    while (keys.size() < 2'000'000)
+    {
+        Key key;
+        randomize(key);
+        if (present.insert(key).second)
+            keys.push_back(key);
+    }
+    std::vector<Key> absent;
+    while (absent.size() < 1'000'000)
+    {
+        Key key;
+        randomize(key);
+        if (present.find(key) == present.end())
+            absent.push_back(key);
+    }
+
+    const auto insert = bench::measure_slices(repetitions, keys.size(), [&](size_t begin, size_t end){
+        for (size_t i = begin; i < end; ++i)
+            tree.insert(keys[i], (int64_t)i);
+    });
+    std::shuffle(keys.begin(), keys.end(), rng);
+
+    const auto dram = tree.getMemoryUsed();
+    const auto nvram = tree.getPersistentMemoryUsed();
+
+    int repeats = 1'000'000;
+    const auto hit = bench::measure(warmup_runs, repetitions, repeats, [&](){
         for (int i = 0; i < repeats; ++i)
         {
-            auto ptr = secondary.search(not_present_secondary[i]);
+            auto ptr = tree.search(keys[i]);
+            assert(ptr != nullptr);
         }
-    }) / static_cast<float>(repeats);
-
-    std::map<size_t, float> primary_scan;
-    std::map<size_t, float> secondary_scan;
+    });
+    const auto miss = bench::measure(warmup_runs, repetitions, repeats, [&](){
+        for (int i = 0; i < repeats; ++i)
+            tree.search(absent[i]);
+    });
+    std::map<size_t, bench::summary> scan;
     for (auto width : {10, 100, 1000})
     {
-        primary_scan[width] = time([&](){
+        scan[width] = bench::measure(warmup_runs, repetitions, repeats / 10, [&](){
             for (int i = 0; i < repeats / 10; ++i)
-            {
-                auto res = primary.scan(primary_keys[i], width);
-            }
-        }) / static_cast<float>(repeats / 10);
-
-        secondary_scan[width] = time([&](){
-            for (int i = 0; i < repeats / 10; ++i)
-            {
-                auto res = secondary.secondaryScan(secondary_keys[i], width);
-            }
-        }) / static_cast<float>(repeats / 10);
+                tree.scan(keys[i], width);
+        });
     }
 
-    std::cout << "Times in ns, storage in bytes" << std::endl;
     std::cout
-        << "Key Size, Row Size, "
-        << "Primary insert, Secondary insert, "
-        << "Primary search hit, Secondary search hit, Primary search miss, Secondary search miss, "
-        << "Primary (DRAM), Secondary (DRAM), Primary (NVRAM), Secondary (NVRAM),"
-        << "PrimaryScan10, PrimaryScan100, PrimaryScan1000,"
-        << "SecondaryScan10, SecondaryScan100, SecondaryScan1000,"
+        << layout_name(layout) << "," << sizeof(Key) << ","
+        << insert.median << "," << hit.median << "," << miss.median << ","
+        << dram << "," << nvram << ","
+        << scan[10].median << "," << scan[100].median << "," << scan[1000].median << ","
         << std::endl;
 
-    std::cout
-        << sizeof(entry_key_t) << "," << sizeof(Data) << ","
-        << primary_insert_time << "," << secondary_insert_time << ","
-        << primary_hit << "," << secondary_hit << "," << primary_miss << "," << secondary_miss << ","
-        << primary_dram << "," << secondary_dram << "," << primary_nvram << "," << secondary_nvram << ","
-        << primary_scan[10] << "," << primary_scan[100] << "," << primary_scan[1000] << ","
-        << secondary_scan[10] << "," << secondary_scan[100] << "," << secondary_scan[1000] << ","
-        << std::endl;
+    if (json != nullptr)
+    {
+        bench::json j(json);
+        j.begin_object();
+        j.key("config").begin_object()
+            .field("layout", layout_name(layout))
+            .field("key_size", (int)sizeof(Key))
+            .field("rows", (int)keys.size())
+            .field("repetitions", repetitions)
+            .end_object();
+        j.field("insert_ns", insert).field("hit_ns", hit).field("miss_ns", miss);
+        j.field("dram_bytes", (unsigned long)dram).field("nvram_bytes", (unsigned long)nvram);
+        j.field("scan10_ns", scan[10]).field("scan100_ns", scan[100]).field("scan1000_ns", scan[1000]);
+        j.end_object();
+        fputc('\n', json);
+    }
+}
+
+using layout_table = std::map<std::pair<size_t, int>, void (*)(int, FILE *)>;
+
+template <size_t... KeyWords>
+void register_layouts(layout_table & table)
+{
+    (table.emplace(std::make_pair(KeyWords, ENTRY_LIST), &layout_experiment<KeyWords, entry_list, wide_pages>), ...);
+    (table.emplace(std::make_pair(KeyWords, COMPACT_PAGES), &layout_experiment<KeyWords, entry_list, compact_pages>), ...);
+#if !defined(USE_PMDK) && !defined(USE_HASH_INDEX) && !defined(USE_DELTA_BUFFER) && !defined(USE_LIST_COMPACTION) && \
+    !defined(USE_CHECKPOINT) && !defined(USE_SNAPSHOTS)
+    (table.emplace(std::make_pair(KeyWords, CHUNK_LIST), &layout_experiment<KeyWords, chunk_list<>, wide_pages>), ...);
+#endif
+}
+
+inline const layout_table & layouts()
+{
+    static const layout_table table = []() {
+        layout_table t;
+        register_layouts<1, 2, 4>(t);
+        return t;
+    }();
+    return table;
+}
+
+// Like run_experiments(), for the layouts compiled in.
+inline bool run_layout_experiments(size_t key_words, int layout, FILE *json = nullptr)
+{
+    char *space = curr_addr;
+    bool found = false;
+    for (const auto & [config, run] : layouts())
+    {
+        if ((key_words != any_size && config.first != key_words) ||
+            (layout != ANY_LAYOUT && config.second != layout))
+            continue;
+        if (!found)
+            print_layout_header();
+        found = true;
+        curr_addr = space;
+        run(config.second, json);
+    }
+    if (!found)
+    {
+        std::cout << "no layout experiment compiled for " << key_words << " key words, available:";
+        for (const auto & entry : layouts())
+            std::cout << " " << entry.first.first << "/" << layout_name(entry.first.second);
+        std::cout << std::endl;
+    }
+    return found;
 }
@@ -5,18 +5,22 @@ import sys
 import time
 
 
-def compile(keysize):
+# Every key/row size experiment is compiled into one binary (see the registry at
+# the end of experiment.hpp), so the sweep builds once and runs once.
+def compile():
     subprocess.run([
         "g++", "-std=c++17", "-m64", "-D_REENTRANT", "-fno-strict-aliasing",
         "-I./atomic_ops", "-DINTEL", "-Wno-unused-value", "-Wno-format",
         "-o", "./experiment.o", "main-gu-zipfian.c", "-lpmemobj", "-lpmem",
         # "-g", # debug
-        "-Og", "-lpthread", f"-DKEYSIZE={keysize}"], check=True)
+        "-O2", "-lpthread"], check=True)
 
 
-def run():
+def run(json_path):
     try:
-        output = subprocess.check_output(["./experiment.o"], stderr=subprocess.PIPE)
+        output = subprocess.check_output(
+            ["./experiment.o", "-E", "-k", "all", "-p", "all", "-N", "all", "-J", json_path],
+            stderr=subprocess.PIPE)
     except subprocess.CalledProcessError as error:
         print("Status : FAIL", error.returncode)
         print(f'stderr: {error.stderr.decode(sys.getfilesystemencoding())}')
@@ -25,16 +29,11 @@ def run():
 
 
 def main():
-    output = ""
-    for keysize in range(1, 100):
-        print(f"Running keysize {keysize}")
-        compile(keysize)
-        res = run()
-        if res == -1:
-            output += "    Error!\n"
-        else:
-            output += run()
     timestamp = time.strftime("%Y%m%d-%H%M%S")
+    compile()
+    output = run(f'keysize-experiment-{timestamp}.json')
+    if output == -1:
+        output = "    Error!\n"
     with open(f'keysize-experiment-{timestamp}.txt', 'w') as f:
         f.write(output)
 
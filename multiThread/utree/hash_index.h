@@ -0,0 +1,265 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+#include "epoch.h"
+
+/*
+ * Concurrent DRAM hash table used as a point lookup cache in front of the tree.
+ * Lookups are lock-free, writers serialize on striped locks. Growing does not
+ * stop the world: the new table links to the old one and writers migrate the
+ * old buckets a few at a time, readers consult both until the old one drains.
+ */
+template <typename Key>
+struct word_hash {
+    size_t operator()(const Key &key) const {
+        uint64_t h = 0x9e3779b97f4a7c15ULL;
+        for (auto w : key) {
+            h ^= (uint64_t)w;
+            h *= 0xff51afd7ed558ccdULL;
+            h ^= h >> 33;
+        }
+        return h;
+    }
+};
+
+template <typename Key, typename Value, typename Hash = word_hash<Key>>
+class hash_index {
+    constexpr static size_t STRIPES = 1024;             // must not exceed the smallest table
+    constexpr static size_t INITIAL_BUCKETS = 1 << 16;
+    constexpr static size_t LOAD_FACTOR = 2;
+    constexpr static size_t MIGRATE_PER_WRITE = 2;
+
+    struct node {
+        Key key;
+        std::atomic<Value> value;
+        std::atomic<node *> next;
+    };
+
+    struct table {
+        size_t size;
+        std::atomic<node *> *buckets;
+        std::atomic<table *> prev{nullptr};   // table still being migrated into this one
+        std::atomic<size_t> migrate_cursor{0};
+        std::atomic<size_t> migrated{0};
+
+        explicit table(size_t n) : size(n) {
+            buckets = new std::atomic<node *>[n];
+            for (size_t i = 0; i < n; ++i)
+                buckets[i].store(nullptr, std::memory_order_relaxed);
+        }
+
+        ~table() {
+            delete[] buckets;
+        }
+    };
+
+    struct alignas(64) stripe {
+        std::mutex mtx;
+        size_t entries = 0;
+    };
+
+    static node *moved() {
+        return reinterpret_cast<node *>(1);
+    }
+
+    Hash hasher;
+    std::atomic<table *> cur;
+    std::unique_ptr<stripe[]> stripes;
+
+    static node *find_in(node *n, const Key &key) {
+        for (; n != nullptr; n = n->next.load(std::memory_order_acquire)) {
+            if (n->key == key)
+                return n;
+        }
+        return nullptr;
+    }
+
+    // Copy one old bucket into t and seal it. Caller holds the bucket's stripe.
+    void migrate_bucket(table *old, table *t, size_t b) {
+        node *head = old->buckets[b].load();
+        if (head == moved())
+            return;
+        for (node *n = head; n != nullptr; n = n->next.load()) {
+            auto &dst = t->buckets[hasher(n->key) & (t->size - 1)];
+            node *copy = new node{n->key, {n->value.load()}, {dst.load()}};
+            dst.store(copy, std::memory_order_release);
+        }
+        old->buckets[b].store(moved());
+        for (node *n = head; n != nullptr; ) {
+            node *next = n->next.load();
+            epoch::retire(n);
+            n = next;
+        }
+        if (old->migrated.fetch_add(1) + 1 == old->size) {
+            t->prev.store(nullptr);
+            epoch::retire(old);
+        }
+    }
+
+    void help_migrate(table *t) {
+        for (size_t i = 0; i < MIGRATE_PER_WRITE; ++i) {
+            table *old = t->prev.load();
+            if (old == nullptr)
+                return;
+            size_t b = old->migrate_cursor.fetch_add(1);
+            if (b >= old->size)
+                return;
+            std::lock_guard<std::mutex> lock(stripes[b & (STRIPES - 1)].mtx);
+            if (cur.load() == t)
+                migrate_bucket(old, t, b);
+        }
+    }
+
+    void maybe_grow(table *t, size_t stripe_entries) {
+        if (stripe_entries * STRIPES <= t->size * LOAD_FACTOR || t->prev.load() != nullptr)
+            return;
+        auto bigger = new table(t->size * 2);
+        bigger->prev.store(t);
+        table *expected = t;
+        if (!cur.compare_exchange_strong(expected, bigger))
+            delete bigger;
+    }
+
+    /*
+     * Lock the stripe of h and return the table writers must use, with the old
+     * bucket for h (if any) already migrated into it.
+     */
+    table *lock_for_write(size_t h, std::unique_lock<std::mutex> &lock) {
+        lock = std::unique_lock<std::mutex>(stripes[h & (STRIPES - 1)].mtx);
+        table *t = cur.load();
+        table *old = t->prev.load();
+        if (old != nullptr)
+            migrate_bucket(old, t, h & (old->size - 1));
+        return t;
+    }
+
+public:
+    hash_index() : stripes(new stripe[STRIPES]) {
+        cur.store(new table(INITIAL_BUCKETS));
+    }
+
+    ~hash_index() {
+        table *t = cur.load();
+        for (table *tab : {t->prev.load(), t}) {
+            if (tab == nullptr)
+                continue;
+            for (size_t i = 0; i < tab->size; ++i) {
+                node *n = tab->buckets[i].load();
+                if (n == moved())
+                    continue;
+                while (n != nullptr) {
+                    node *next = n->next.load();
+                    delete n;
+                    n = next;
+                }
+            }
+            delete tab;
+        }
+    }
+
+    bool find(const Key &key, Value &value) {
+        epoch::guard g;
+        size_t h = hasher(key);
+retry:
+        table *t = cur.load();
+        table *old = t->prev.load();
+        if (old != nullptr) {
+            node *head = old->buckets[h & (old->size - 1)].load(std::memory_order_acquire);
+            if (head != moved()) {
+                node *n = find_in(head, key);
+                if (n == nullptr)
+                    return false;
+                value = n->value.load();
+                return true;
+            }
+        }
+        node *head = t->buckets[h & (t->size - 1)].load(std::memory_order_acquire);
+        if (head == moved())   // t itself got superseded meanwhile
+            goto retry;
+        node *n = find_in(head, key);
+        if (n == nullptr)
+            return false;
+        value = n->value.load();
+        return true;
+    }
+
+    // Insert or overwrite the mapping for key.
+    void insert(const Key &key, Value value) {
+        epoch::guard g;
+        size_t h = hasher(key);
+        std::unique_lock<std::mutex> lock;
+        table *t = lock_for_write(h, lock);
+        auto &bucket = t->buckets[h & (t->size - 1)];
+        node *head = bucket.load();
+        if (node *n = find_in(head, key)) {
+            n->value.store(value);
+            return;
+        }
+        bucket.store(new node{key, {value}, {head}}, std::memory_order_release);
+        size_t entries = ++stripes[h & (STRIPES - 1)].entries;
+        lock.unlock();
+
+        maybe_grow(t, entries);
+        help_migrate(cur.load());
+    }
+
+    bool erase(const Key &key) {
+        return erase_if(key, [](const Value &) { return true; });
+    }
+
+    // Erase key only while it still maps to value, not to what a later insert put there.
+    bool erase(const Key &key, Value value) {
+        return erase_if(key, [&](const Value &v) { return v == value; });
+    }
+
+    template <typename F>
+    bool erase_if(const Key &key, F match) {
+        epoch::guard g;
+        size_t h = hasher(key);
+        std::unique_lock<std::mutex> lock;
+        table *t = lock_for_write(h, lock);
+        std::atomic<node *> *link = &t->buckets[h & (t->size - 1)];
+        for (node *n = link->load(); n != nullptr; n = link->load()) {
+            if (n->key == key) {
+                if (!match(n->value.load()))
+                    return false;
+                link->store(n->next.load(), std::memory_order_release);
+                --stripes[h & (STRIPES - 1)].entries;
+                lock.unlock();
+                epoch::retire(n);
+                help_migrate(cur.load());
+                return true;
+            }
+            link = &n->next;
+        }
+        return false;
+    }
+
+    // Drop every entry, used before rebuilding from the shadow list.
+    void clear() {
+        table *t = cur.exchange(new table(INITIAL_BUCKETS));
+        for (size_t i = 0; i < STRIPES; ++i) {
+            std::lock_guard<std::mutex> lock(stripes[i].mtx);
+            stripes[i].entries = 0;
+        }
+        for (table *tab : {t->prev.load(), t}) {
+            if (tab == nullptr)
+                continue;
+            for (size_t i = 0; i < tab->size; ++i) {
+                node *n = tab->buckets[i].load();
+                if (n == moved())
+                    continue;
+                while (n != nullptr) {
+                    node *next = n->next.load();
+                    epoch::retire(n);
+                    n = next;
+                }
+            }
+            epoch::retire(tab);
+        }
+    }
+};
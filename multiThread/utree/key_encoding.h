@@ -0,0 +1,157 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <initializer_list>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Byte-comparable keys. Each word is stored big-endian, so the byte order of
+ * the whole key is its sort order and two keys compare with one memcmp-style
+ * pass (16 bytes at a time with SSE2) instead of a word-by-word loop with a
+ * branch per word. Usable as the key type K of btree<T, K>.
+ */
+template <size_t Words>
+struct normalized_key {
+    constexpr static size_t BYTES = Words * sizeof(uint64_t);
+
+    uint64_t be[Words];
+
+    normalized_key() = default;
+
+    // Words in key order, like entry_key_t's {v, ...}; missing words are 0.
+    normalized_key(std::initializer_list<uint64_t> words) {
+        size_t i = 0;
+        for (auto w : words)
+            be[i++] = __builtin_bswap64(w);
+        for (; i < Words; ++i)
+            be[i] = 0;
+    }
+
+    static normalized_key from_words(const std::array<uint64_t, Words> &words) {
+        normalized_key ret;
+        for (size_t i = 0; i < Words; ++i)
+            ret.be[i] = __builtin_bswap64(words[i]);
+        return ret;
+    }
+
+    std::array<uint64_t, Words> words() const {
+        std::array<uint64_t, Words> ret;
+        for (size_t i = 0; i < Words; ++i)
+            ret[i] = __builtin_bswap64(be[i]);
+        return ret;
+    }
+
+    const unsigned char *bytes() const { return reinterpret_cast<const unsigned char *>(be); }
+    unsigned char *bytes() { return reinterpret_cast<unsigned char *>(be); }
+
+    // <0, 0, >0 like memcmp.
+    int compare(const normalized_key &o) const {
+        const unsigned char *a = bytes(), *b = o.bytes();
+        size_t i = 0;
+#ifdef __SSE2__
+        for (; i + 16 <= BYTES; i += 16) {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+            __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+            unsigned diff = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ 0xffff;
+            if (diff) {
+                size_t j = i + __builtin_ctz(diff);
+                return (int)a[j] - (int)b[j];
+            }
+        }
+#endif
+        for (; i < BYTES; i += 8) {
+            uint64_t x = __builtin_bswap64(be[i / 8]), y = __builtin_bswap64(o.be[i / 8]);
+            if (x != y)
+                return x < y ? -1 : 1;
+        }
+        return 0;
+    }
+
+    // Bytes shared with o from the start, the input for prefix truncation.
+    size_t common_prefix(const normalized_key &o) const {
+        for (size_t i = 0; i < Words; ++i) {
+            uint64_t x = be[i] ^ o.be[i];
+            if (x)
+                return i * 8 + __builtin_ctzll(x) / 8;  // first differing byte in memory order
+        }
+        return BYTES;
+    }
+
+    // One byte summary of the key, e.g. for leaf fingerprints.
+    uint8_t fingerprint() const {
+        uint64_t h = 0x9e3779b97f4a7c15ULL;
+        for (auto w : be) {
+            h ^= w;
+            h *= 0xff51afd7ed558ccdULL;
+        }
+        return (uint8_t)(h >> 56);
+    }
+
+    bool operator==(const normalized_key &o) const { return memcmp(be, o.be, BYTES) == 0; }
+    bool operator!=(const normalized_key &o) const { return !(*this == o); }
+    bool operator<(const normalized_key &o) const { return compare(o) < 0; }
+    bool operator>(const normalized_key &o) const { return compare(o) > 0; }
+    bool operator<=(const normalized_key &o) const { return compare(o) <= 0; }
+    bool operator>=(const normalized_key &o) const { return compare(o) >= 0; }
+
+    // Encoded words, for hashing (hash_index, delta_buffer).
+    const uint64_t *begin() const { return be; }
+    const uint64_t *end() const { return be + Words; }
+};
+
+/*
+ * Order-preserving transforms into unsigned words. Encode signed values and
+ * strings with these before building a key so that byte order stays sort order.
+ */
+inline uint64_t encode_signed(int64_t v) {
+    return (uint64_t)v ^ (1ULL << 63);
+}
+
+inline int64_t decode_signed(uint64_t w) {
+    return (int64_t)(w ^ (1ULL << 63));
+}
+
+// IEEE doubles: flip the sign bit of positives, every bit of negatives.
+inline uint64_t encode_double(double d) {
+    uint64_t w;
+    memcpy(&w, &d, sizeof(w));
+    return (w >> 63) ? ~w : w | (1ULL << 63);
+}
+
+inline double decode_double(uint64_t w) {
+    w = (w >> 63) ? w & ~(1ULL << 63) : ~w;
+    double d;
+    memcpy(&d, &w, sizeof(d));
+    return d;
+}
+
+/*
+ * Strings compare bytewise, so their bytes go into the key as they are,
+ * zero padded. Strings longer than the key are truncated (keys then order by
+ * prefix), and a string is not distinguished from itself plus trailing zeros.
+ */
+template <size_t Words>
+normalized_key<Words> encode_string(const char *s, size_t len) {
+    normalized_key<Words> ret;
+    memset(ret.be, 0, sizeof(ret.be));
+    memcpy(ret.bytes(), s, len < sizeof(ret.be) ? len : sizeof(ret.be));
+    return ret;
+}
+
+namespace std {
+template <size_t Words>
+struct hash<normalized_key<Words>> {
+    size_t operator()(const normalized_key<Words> &k) const {
+        size_t h = 0;
+        for (auto w : k)
+            h = h * 31 + std::hash<uint64_t>()(w);
+        return h;
+    }
+};
+}
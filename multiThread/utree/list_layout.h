@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "pm_ptr.h"
+
+/*
+ * Shadow list layouts, the L parameter of btree<T, K, L>.
+ *
+ * entry_list keeps one list_node_t per key, linked in key order, which is the
+ * uTree layout. chunk_list packs the keys into XPLine sized PM chunks instead:
+ * each chunk holds a few key/value slots and a bitmap of the live ones, and
+ * the chunks are chained in allocation order. Key order comes from the DRAM
+ * leaves, whose entries point at the slots. A scan then reads a dozen or so
+ * entries per PM line instead of one, and an insert writes its slot and the
+ * bitmap word in the same 256 byte line instead of a new node plus its
+ * predecessor's next.
+ */
+struct entry_list {
+    constexpr static bool chunked = false;
+    template <typename T, typename K>
+    using chunk = void;
+};
+
+template <size_t Bytes = 256>
+struct chunk_list {
+    constexpr static bool chunked = true;
+    constexpr static size_t CHUNK_BYTES = Bytes;
+    template <typename T, typename K>
+    struct chunk;
+};
+
+/*
+ * One chunk. valid is the persistent state: a slot counts once its bit is set
+ * (one 8-byte store, flushed), so a slot is written and flushed first. claimed
+ * hands slots out to concurrent writers and is rebuilt from valid on restart.
+ * Removed slots stay claimed, a reader may still hold a pointer into them.
+ */
+template <size_t Bytes>
+template <typename T, typename K>
+struct alignas(Bytes) chunk_list<Bytes>::chunk {
+    struct slot {       // same prefix as list_node_t, value first
+        T value;
+        K key;
+    };
+    constexpr static int SLOTS = (Bytes - 2 * sizeof(uint64_t) - sizeof(void *)) / sizeof(slot);
+    static_assert((Bytes & (Bytes - 1)) == 0, "chunk size must be a power of two");
+    static_assert(SLOTS >= 2 && SLOTS <= 64, "chunk size does not fit 2 to 64 slots of this key/value");
+
+    std::atomic<uint64_t> valid;
+    std::atomic<uint64_t> claimed;
+    pm::link<chunk> next;
+    slot slots[SLOTS];
+
+    constexpr static uint64_t ALL = SLOTS == 64 ? ~0ULL : (1ULL << SLOTS) - 1;
+
+    static chunk *of(const void *s) {
+        return (chunk *)((uintptr_t)s & ~(uintptr_t)(Bytes - 1));
+    }
+    uint64_t bit(const slot *s) const {
+        return 1ULL << (s - slots);
+    }
+
+    // A free slot, nullptr if the chunk is full.
+    slot *claim() {
+        uint64_t c = claimed.load(std::memory_order_relaxed);
+        while (c != ALL) {
+            int i = __builtin_ctzll(~c);
+            if (claimed.compare_exchange_weak(c, c | (1ULL << i)))
+                return &slots[i];
+        }
+        return nullptr;
+    }
+
+    // Hand back a slot that never became valid.
+    void release(const slot *s) {
+        claimed.fetch_and(~bit(s));
+    }
+};
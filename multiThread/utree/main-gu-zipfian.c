@@ -10,7 +10,10 @@
 #include <sys/mman.h>
 #include <sys/time.h>
 
+#include "bench.h"
+#include "perf_counters.h"
 #include "experiment.hpp"
+#include "parallel_scan.h"
 
 extern "C"
 {
@@ -29,6 +32,8 @@ typedef void*               setval_t;
 #define DEFAULT_ALTERNATE               0
 #define DEFAULT_EFFECTIVE               0 
 #define DEFAULT_UNBALANCED              0
+#define DEFAULT_WARMUP                  1000
+#define DEFAULT_REPETITIONS             5
 
 #define XSTR(s)                         STR(s)
 #define STR(s)                          #s
@@ -130,6 +135,7 @@ long rand_range(long r);
 
 bool simulate_conflict = false;
 long max_range = 0;
+double zipf_theta = ZipfianGenerator::kZipfianConst;
 
 /* Thread-safe, re-entrant version of rand_range(r) */
 inline long rand_range_re(unsigned int *seed, long r) {
@@ -175,7 +181,13 @@ typedef struct thread_data {
     barrier_t     *barrier;
     unsigned long failures_because_contention;
     char * start_addr;
+    char * curr_addr;                  // where the thread's allocations continue next run
     int affinityNodeID;
+    double rate;                       // open-loop ops/s of this thread, 0 = closed loop
+    bool poisson;
+    bench::histogram *latency;         // open loop: from intended start to completion
+    bench::histogram *service;         // open loop: from actual start to completion
+    perf::values  perf;                // hardware counters over the measured runs
     uint64_t padding[16];
 } thread_data_t;
 
@@ -192,13 +204,24 @@ void *test(void *data)
     if (ret)
       perror("pthread_setaffinity_np");
     start_addr = d->start_addr;
-    curr_addr = start_addr;
+    curr_addr = d->curr_addr;
     barrier_cross(d->barrier);                                         /* Wait on barrier */
     unext = (rand_range_re(&d->seed, 100) - 1 < d->update);            /* Is the first op an update? */
 #ifndef UNIFORM
-    ZipfianGenerator zf(max_range);
+    ZipfianGenerator zf(0, max_range - 1, zipf_theta);
 #endif
+    bench::arrival_schedule arrivals(d->rate > 0 ? d->rate : 1, d->poisson, d->seed, bench::now_ns());
+    uint64_t intended = 0, started = 0;
+    perf::group pmu;
+    pmu.start();
     while (stop == 0) {
+        if (d->rate > 0) {
+            intended = arrivals.next();
+            bench::wait_until(intended, stop);
+            if (stop)
+                break;
+            started = bench::now_ns();
+        }
 
         if (unext) {   
 #ifdef UNIFORM
@@ -219,7 +242,7 @@ void *test(void *data)
                 if (d->id == 1){
                     clock_gettime(CLOCK_MONOTONIC, &T2);
                     latency = ((T2.tv_sec - T1.tv_sec) * 1000000000 + (T2.tv_nsec - T1.tv_nsec)) / 100;
-                    record[latency] += 1;
+                    record[std::min<uint64_t>(latency, 999999)] += 1;
                     insert_nb += 1;
                 }
                 
@@ -263,7 +286,7 @@ void *test(void *data)
                 if (d->id == 1){
                     clock_gettime(CLOCK_MONOTONIC, &T2);
                     latency = ((T2.tv_sec - T1.tv_sec) * 1000000000 + (T2.tv_nsec - T1.tv_nsec)) / 100;
-                    record[latency] += 1;
+                    record[std::min<uint64_t>(latency, 999999)] += 1;
                     insert_nb += 1;
                 }
                 
@@ -271,6 +294,12 @@ void *test(void *data)
             d->nb_contains++;
         }
 
+        if (d->rate > 0) {
+            uint64_t done = bench::now_ns();
+            d->latency->add(done - intended);
+            d->service->add(done - started);
+        }
+
         /* Is the next op an update? */
         if (d->effective)                                              // a failed remove/add is a read-only tx
             unext = ((100 * (d->nb_added + d->nb_removed)) < (d->update * (d->nb_add + d->nb_remove + d->nb_contains)));
@@ -278,34 +307,53 @@ void *test(void *data)
             unext = (rand_range_re(&d->seed, 100) - 1 < d->update);
 
     }
-#ifdef DETECT_LATENCY
-    if (d->id == 1){
-        uint64_t cnt = 0;
-        uint64_t nb_50 = insert_nb / 2;
-        uint64_t nb_90 = insert_nb * 0.9;
-        uint64_t nb_99 = insert_nb * 0.99;
-        bool flag_50 = false, flag_90 = false, flag_99 = false;
-        double latency_50, latency_90, latency_99;
-
-        for (int i=0; i < 1000000 && !(flag_50 && flag_90 && flag_99); i++){
-            cnt += record[i];
-            if (!flag_50 && cnt >= nb_50){
-                latency_50 = (double)i / 10.0;
-                flag_50 = true;
-            }
-            if (!flag_90 && cnt >= nb_90){
-                latency_90 = (double)i / 10.0;
-                flag_90 = true;
-            }
-            if (!flag_99 && cnt >= nb_99){
-                latency_99 = (double)i / 10.0;
-                flag_99 = true;
-            }
+    d->perf += pmu.stop();
+    counters::values c = counters::local();
+    d->nb_aborts_locked_write += c[counters::INSERT_RETRY_IS_UPDATE];
+    d->nb_aborts_validate_write += c[counters::INSERT_RETRY_CAS];
+    d->nb_aborts_validate_read += c[counters::INSERT_RETRY_VIEW];
+    d->nb_aborts = d->nb_aborts_locked_write + d->nb_aborts_validate_write + d->nb_aborts_validate_read;
+    d->failures_because_contention += c[counters::INSERT_GAVE_UP];
+    d->max_retries = std::max<unsigned long>(d->max_retries, c[counters::INSERT_MAX_RETRIES]);
+    d->curr_addr = curr_addr;
+    return NULL;
+}
+
+/* Latency percentiles (us) of the ops thread 1 recorded since record was cleared. */
+void latency_percentiles(double *latency_50, double *latency_90, double *latency_99)
+{
+    uint64_t cnt = 0;
+    uint64_t nb_50 = insert_nb / 2;
+    uint64_t nb_90 = insert_nb * 0.9;
+    uint64_t nb_99 = insert_nb * 0.99;
+    bool flag_50 = false, flag_90 = false, flag_99 = false;
+    *latency_50 = *latency_90 = *latency_99 = 0;
+
+    for (int i=0; i < 1000000 && !(flag_50 && flag_90 && flag_99); i++){
+        cnt += record[i];
+        if (!flag_50 && cnt >= nb_50){
+            *latency_50 = (double)i / 10.0;
+            flag_50 = true;
+        }
+        if (!flag_90 && cnt >= nb_90){
+            *latency_90 = (double)i / 10.0;
+            flag_90 = true;
+        }
+        if (!flag_99 && cnt >= nb_99){
+            *latency_99 = (double)i / 10.0;
+            flag_99 = true;
         }
-        printf("medium latency is %.1lfus\n90%% latency is %.1lfus\n99%% latency is %.1lfus\n", latency_50, latency_90, latency_99);
     }
-#endif
-    return NULL;
+}
+
+unsigned long total_ops(thread_data_t *data, int nb_threads)
+{
+    unsigned long ops = 0;
+    for (int i = 0; i < nb_threads; i++)
+        ops += __atomic_load_n(&data[i].nb_add, __ATOMIC_RELAXED) +
+               __atomic_load_n(&data[i].nb_remove, __ATOMIC_RELAXED) +
+               __atomic_load_n(&data[i].nb_contains, __ATOMIC_RELAXED);
+    return ops;
 }
 
 void catcher(int sig)
@@ -318,6 +366,7 @@ int main(int argc, char **argv)
     struct option long_options[] = {
         // These options don't set a flag
         {"help",                      no_argument,       NULL, 'h'},
+        {"experiment",                no_argument,       NULL, 'E'},
         {"duration",                  required_argument, NULL, 'd'},
         {"initial-size",              required_argument, NULL, 'i'},
         {"thread-num",                required_argument, NULL, 't'},
@@ -326,46 +375,20 @@ int main(int argc, char **argv)
         {"update-rate",               required_argument, NULL, 'u'},
         {"unbalance",                 required_argument, NULL, 'U'},
         {"elasticity",                required_argument, NULL, 'x'},
+        {"skew",                      required_argument, NULL, 'z'},
+        {"warmup",                    required_argument, NULL, 'W'},
+        {"repetitions",               required_argument, NULL, 'R'},
+        {"json",                      required_argument, NULL, 'J'},
+        {"rate",                      required_argument, NULL, 'O'},
+        {"poisson",                   no_argument,       NULL, 'P'},
+        {"key-words",                 required_argument, NULL, 'k'},
+        {"padding-words",             required_argument, NULL, 'p'},
+        {"key-encoding",              required_argument, NULL, 'N'},
+        {"layout",                    required_argument, NULL, 'L'},
+        {"scan-threads",              required_argument, NULL, 'G'},
         {NULL,                        0,                 NULL, 0  }
     };
 
-
-
-    bindCPU();
-    int fd[2];
-    fd[0] = open("/dev/dax0.0", O_RDWR);
-    fd[1] = open("/dev/dax1.0", O_RDWR);
-    if (fd[0] == -1)
-    {
-        perror("open0");
-        exit(1);
-    }
-    if (fd[1] == -1)
-    {
-        perror("open1");
-        exit(1);
-    }
-    void *pmem[2];
-    const uint64_t allocate_size = 700ULL * 1024ULL * 1024ULL * 1024ULL;
-    for (int i=0; i<2; i++){
-      pmem[i] = mmap(NULL, allocate_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd[i], 0);
-      if (pmem[i] == (void*) -1)
-      {
-        perror("mmap");
-        exit(1);
-      }
-      thread_space_start_addr[i] = (char *)pmem[i] + SPACE_OF_MAIN_THREAD;
-    }
-    start_addr = (char *)pmem[0];
-    curr_addr = start_addr;
-    
-    memset(record, 0, sizeof(record));
-
-    experiment();
-
-    exit(0);
-
-    printf("simplified version:\n");
     int i = 0;
     int duration =    DEFAULT_DURATION;
     int initial =     DEFAULT_INITIAL;
@@ -376,9 +399,20 @@ int main(int argc, char **argv)
     int alternate =   DEFAULT_ALTERNATE;
     int effective =   DEFAULT_EFFECTIVE;
     int unbalanced =  DEFAULT_UNBALANCED;
+    int warmup =      DEFAULT_WARMUP;
+    int repetitions = DEFAULT_REPETITIONS;
+    bool run_experiment = false;
+    const char *json_path = NULL;
+    double rate = 0;
+    bool poisson = false;
+    size_t key_words = any_size;
+    size_t padding_words = default_padding_size;
+    int encoding = ARRAY_KEYS;
+    int layout = -1;
+    int scan_threads = 0;
     while(1) {
         i = 0;
-        int c = getopt_long(argc, argv, "hAf:d:i:t:r:S:u:U:c:", long_options, &i);
+        int c = getopt_long(argc, argv, "hAEPf:d:i:t:r:S:u:U:c:z:W:R:J:O:k:p:N:L:G:", long_options, &i);
         if(c == -1) break;
         if(c == 0 && long_options[i].flag == 0) c = long_options[i].val;
 
@@ -393,6 +427,16 @@ int main(int argc, char **argv)
                                  "Options:\n"
                                  "  -h, --help\n"
                                  "        Print this message\n"
+                                 "  -E, --experiment\n"
+                                 "        Run the single-thread key/row size experiment instead\n"
+                                 "  -k, --key-words <int|all>\n"
+                                 "        Experiment: key size in 8-byte words (default=all compiled in)\n"
+                                 "  -p, --padding-words <int|all>\n"
+                                 "        Experiment: row padding in 8-byte words (default=64)\n"
+                                 "  -N, --key-encoding <array|normalized|all>\n"
+                                 "        Experiment: word-array keys or byte-comparable normalized keys (default=array)\n"
+                                 "  -L, --layout <entry|chunk|compact|all>\n"
+                                 "        Run the single-thread shadow list layout comparison instead, for -k key words\n"
                                  "  -A, --Alternate\n"
                                  "        Consecutive insert/remove target the same value\n"
                                  "  -f, --effective <int>\n"
@@ -413,11 +457,28 @@ int main(int argc, char **argv)
                                  "        Percentage of skewness of the distribution of values (default=" XSTR(DEFAULT_UNBALANCED) ")\n"
                                  "  -c, --conflict ratio <int>\n"
                                  "        Percentage of conflict among threads \n"
+                                 "  -z, --skew <double>\n"
+                                 "        Zipfian constant of the key distribution, in [0, 1) (default=0.99)\n"
+                                 "  -W, --warmup <int>\n"
+                                 "        Untimed warmup run in milliseconds before the measured runs (default=" XSTR(DEFAULT_WARMUP) ")\n"
+                                 "  -R, --repetitions <int>\n"
+                                 "        Number of measured runs of <duration> each (default=" XSTR(DEFAULT_REPETITIONS) ")\n"
+                                 "  -J, --json <file>\n"
+                                 "        Also write the results as JSON to <file>\n"
+                                 "  -O, --rate <double>\n"
+                                 "        Open loop: offer this many ops/s in total, latency counts from the intended start (0=closed loop, default=0)\n"
+                                 "  -P, --poisson\n"
+                                 "        Open loop: Poisson arrivals instead of evenly spaced ones\n"
+                                 "  -G, --scan-threads <int>\n"
+                                 "        After the load, time a parallel count/sum over all keys with 1, 2, 4, ... up to <int> threads (0=off, default=0)\n"
                                  );
                     exit(0);
                 case 'A':
                     alternate = 1;
                     break;
+                case 'E':
+                    run_experiment = true;
+                    break;
                 case 'f':
                     effective =  atoi(optarg);
                     break;
@@ -446,6 +507,42 @@ int main(int argc, char **argv)
                     //simulate_conflict = true;
                     //max_range = NODE_MAX / 2 * (100.0 / atoi(optarg));
                     break;
+                case 'z':
+                    zipf_theta = atof(optarg);
+                    break;
+                case 'W':
+                    warmup =     atoi(optarg);
+                    break;
+                case 'R':
+                    repetitions = atoi(optarg);
+                    break;
+                case 'J':
+                    json_path =  optarg;
+                    break;
+                case 'O':
+                    rate =       atof(optarg);
+                    break;
+                case 'P':
+                    poisson =    true;
+                    break;
+                case 'k':
+                    key_words =  strcmp(optarg, "all") ? atol(optarg) : any_size;
+                    break;
+                case 'p':
+                    padding_words = strcmp(optarg, "all") ? atol(optarg) : any_size;
+                    break;
+                case 'N':
+                    encoding =   !strcmp(optarg, "all") ? ANY_ENCODING :
+                                 !strcmp(optarg, "normalized") ? NORMALIZED_KEYS : ARRAY_KEYS;
+                    break;
+                case 'L':
+                    layout =     !strcmp(optarg, "all") ? ANY_LAYOUT :
+                                 !strcmp(optarg, "chunk") ? CHUNK_LIST :
+                                 !strcmp(optarg, "compact") ? COMPACT_PAGES : ENTRY_LIST;
+                    break;
+                case 'G':
+                    scan_threads = atoi(optarg);
+                    break;
                 case '?':
                     printf("Use -h or --help for help\n");
                     exit(0);
@@ -454,6 +551,67 @@ int main(int argc, char **argv)
         }
     }
 
+    FILE *json_file = NULL;
+    if (json_path != NULL && (json_file = fopen(json_path, "w")) == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+
+    bindCPU();
+    void *pmem[2];
+    const uint64_t allocate_size = 700ULL * 1024ULL * 1024ULL * 1024ULL;
+#ifdef USE_VOLATILE
+    // DRAM-only build: same per-thread spaces, in anonymous memory
+    for (int i=0; i<2; i++){
+      pmem[i] = mmap(NULL, allocate_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (pmem[i] == (void*) -1)
+      {
+        perror("mmap");
+        exit(1);
+      }
+      thread_space_start_addr[i] = (char *)pmem[i] + SPACE_OF_MAIN_THREAD;
+    }
+#else
+    int fd[2];
+    fd[0] = open("/dev/dax0.0", O_RDWR);
+    fd[1] = open("/dev/dax1.0", O_RDWR);
+    if (fd[0] == -1)
+    {
+        perror("open0");
+        exit(1);
+    }
+    if (fd[1] == -1)
+    {
+        perror("open1");
+        exit(1);
+    }
+    for (int i=0; i<2; i++){
+      pmem[i] = mmap(NULL, allocate_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd[i], 0);
+      if (pmem[i] == (void*) -1)
+      {
+        perror("mmap");
+        exit(1);
+      }
+      thread_space_start_addr[i] = (char *)pmem[i] + SPACE_OF_MAIN_THREAD;
+    }
+#endif
+    for (int i=0; i<2; i++)
+      pm::attach(i + 1, (char *)pmem[i], allocate_size);   // dax0.0 is pool 1, dax1.0 pool 2
+    start_addr = (char *)pmem[0];
+    curr_addr = start_addr;
+    
+    memset(record, 0, sizeof(record));
+
+    if (run_experiment || layout >= 0) {
+        bool found = layout >= 0 ? run_layout_experiments(key_words, layout, json_file)
+                                 : run_experiments(key_words, padding_words, encoding, json_file);
+        if (json_file != NULL)
+            fclose(json_file);
+        exit(found ? 0 : 1);
+    }
+
+    printf("simplified version:\n");
     max_range = initial;
 
     assert(duration >= 0);
@@ -461,6 +619,9 @@ int main(int argc, char **argv)
     assert(nb_threads > 0);
     assert(range > 0 && range >= initial);
     assert(update >= 0 && update <= 100);
+    assert(zipf_theta >= 0 && zipf_theta < 1);
+    assert(warmup >= 0 && repetitions > 0);
+    assert(rate >= 0);
 
     printf("Set type     : skip list\n");
     printf("Duration     : %d\n",  duration);
@@ -471,11 +632,14 @@ int main(int argc, char **argv)
     printf("Update rate  : %d\n",  update);
     printf("Alternate    : %d\n",  alternate);
     printf("Efffective   : %d\n",  effective);
+    printf("Skew         : %.2f\n", zipf_theta);
+    printf("Persistence  : %s\n", persistent ? "persistent (PM)" : "volatile (DRAM)");
+    printf("Warmup       : %d\n",  warmup);
+    printf("Repetitions  : %d\n",  repetitions);
+    if (rate > 0)
+        printf("Offered load : %.0f ops/s (%s arrivals)\n", rate, poisson ? "poisson" : "fixed");
     printf("Type sizes   : int=%d/long=%d/ptr=%d/word=%d\n",
                                    (int)sizeof(int), (int)sizeof(long), (int)sizeof(void *), (int)sizeof(uintptr_t));
-    struct timespec timeout;
-    timeout.tv_sec =               duration / 1000;
-    timeout.tv_nsec =              (duration % 1000) * 1000000;
 
     thread_data_t * data = (thread_data_t *)malloc(nb_threads * sizeof(thread_data_t));
     if (data == nullptr) {
@@ -495,7 +659,14 @@ int main(int argc, char **argv)
 
     /* create the skip list set and do inits */
     global_id = nb_threads * update / 100;
+#ifdef USE_RELATIVE_PTR
+    // pool 1 starts with the superblock read-only processes attach through (attach.h)
+    auto superblock = (attach::superblock *)reserve_space(attach::SUPERBLOCK_BYTES);
+#endif
     auto bt = new btree<int64_t>();
+#ifdef USE_RELATIVE_PTR
+    bt->publish(superblock);
+#endif
     
     stop = 0;
 
@@ -519,63 +690,76 @@ int main(int argc, char **argv)
 
     setkey_t last = 0;
     setkey_t val = 0;
-    for (uint64_t i; i < initial; ++i) {
+    perf::group load_pmu;
+    load_pmu.start();
+    for (uint64_t i = 0; i < initial; ++i) {
         bt->insert({i}, i);
         last = val;
     }
+    perf::values load_perf = load_pmu.stop().per_op(initial);
 
     gettimeofday(&end_time, NULL);
     time_interval = 1000000 * (end_time.tv_sec - start_time.tv_sec) + end_time.tv_usec - start_time.tv_usec;
     printf("Insert time_interval = %lu ns\n", time_interval * 1000);
     printf("average insert op = %lu ns\n",    time_interval * 1000 / initial);
     printf("Level max    : %d\n",             levelmax);
+    printf("Load hardware counters per op:\n");
+    perf::print(load_perf);
+
+    /*
+     * Full-range count and sum with a growing number of scan threads, spread
+     * over both sockets. Each point is the median of <repetitions> scans.
+     */
+    struct scan_agg {
+        uint64_t rows = 0;
+        int64_t sum = 0;
+    };
+    std::vector<int> scan_widths;
+    for (int w = 1; w < scan_threads; w *= 2)
+        scan_widths.push_back(w);
+    if (scan_threads > 0)
+        scan_widths.push_back(scan_threads);
+    std::vector<std::pair<int, bench::summary>> scan_results;
+    for (int w : scan_widths) {
+        std::vector<double> rows_per_s;
+        scan_agg agg;
+        for (int rep = 0; rep < repetitions; rep++) {
+            gettimeofday(&start_time, NULL);
+            agg = parallel::scan(*bt, entry_key_t{0}, entry_key_t{(uint64_t)initial}, w, scan_agg{},
+                [](scan_agg &a, const entry_key_t &, const int64_t &v) { a.rows++; a.sum += v; },
+                [](scan_agg &into, const scan_agg &from) { into.rows += from.rows; into.sum += from.sum; },
+                {cpuset[0], cpuset[1]});
+            gettimeofday(&end_time, NULL);
+            time_interval = 1000000 * (end_time.tv_sec - start_time.tv_sec) + end_time.tv_usec - start_time.tv_usec;
+            rows_per_s.push_back(agg.rows * 1e6 / (time_interval ? time_interval : 1));
+        }
+        scan_results.push_back({w, bench::summarize(rows_per_s)});
+        printf("Parallel scan: %d threads, %lu rows (sum %ld), %f rows/s median\n",
+               w, agg.rows, agg.sum, scan_results.back().second.median);
+    }
 
-    // Access set from all threads
-    barrier_t         barrier;
-    barrier_init(&barrier, nb_threads + 1);
-    pthread_attr_t    attr;
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
     for (int i = 0; i < nb_threads; i++) {
       int nodeID = i & 0x1;
-      printf("Creating thread %d\n", i);
       data[i].id = i + 1;
       data[i].first = last;
       data[i].range = range;
       data[i].update = update;
       data[i].alternate = alternate;
       data[i].effective = effective;
-      data[i].nb_add = 0;
-      data[i].nb_added = 0;
-      data[i].nb_remove = 0;
-      data[i].nb_removed = 0;
-      data[i].nb_contains = 0;
-      data[i].nb_found = 0;
-      data[i].nb_aborts = 0;
-      data[i].nb_aborts_locked_read = 0;
-      data[i].nb_aborts_locked_write = 0;
-      data[i].nb_aborts_validate_read = 0;
-      data[i].nb_aborts_validate_write = 0;
-      data[i].nb_aborts_validate_commit = 0;
-      data[i].nb_aborts_invalid_memory = 0;
-      data[i].nb_aborts_double_write = 0;
-      data[i].max_retries = 0;
       data[i].seed = rand();
       data[i].set = bt;
-      data[i].barrier = &barrier;
-      data[i].failures_because_contention = 0;
       data[i].start_addr = thread_space_start_addr[nodeID] + (i / 2) * SPACE_PER_THREAD;
+      data[i].curr_addr = data[i].start_addr;
       data[i].affinityNodeID = nodeID;
+      data[i].rate = rate / nb_threads;
+      data[i].poisson = poisson;
+      data[i].latency = rate > 0 ? new bench::histogram() : NULL;
+      data[i].service = rate > 0 ? new bench::histogram() : NULL;
       if (reinterpret_cast<size_t>(data[i].start_addr) % 4 != 0)
       {
           std::cerr << "Unaligned thread start at " << reinterpret_cast<size_t>(curr_addr) << " in thread " << i << std::endl;
       }
-      if (pthread_create(&threads[i], &attr, test, (void *)(&data[i])) != 0) {
-        fprintf(stderr, "Error creating thread\n");
-        exit(1);
-      }
     }
-    pthread_attr_destroy(&attr);
 
     // Catch some signals
     if (signal(SIGHUP, catcher) == SIG_ERR ||
@@ -593,41 +777,144 @@ int main(int argc, char **argv)
       printf("\n");
     }
 
-    // Start threads
-    barrier_cross(&barrier);                                           
+    /*
+     * One untimed warmup run, then <repetitions> measured runs over the same
+     * tree. Counters accumulate over the measured runs only.
+     */
+    std::vector<double> run_throughput, run_p50, run_p90, run_p99, run_p999, run_service_p99;
+    std::vector<std::vector<double>> run_timeline;
+    counters::values events_before{};
+    unsigned long measured_ms = 0;
+    for (int run = warmup > 0 ? -1 : 0; run < repetitions; run++) {
+      if (run <= 0) {
+        for (int i = 0; i < nb_threads; i++) {
+          data[i].nb_add = 0;
+          data[i].nb_added = 0;
+          data[i].nb_remove = 0;
+          data[i].nb_removed = 0;
+          data[i].nb_contains = 0;
+          data[i].nb_found = 0;
+          data[i].nb_aborts = 0;
+          data[i].nb_aborts_locked_read = 0;
+          data[i].nb_aborts_locked_write = 0;
+          data[i].nb_aborts_validate_read = 0;
+          data[i].nb_aborts_validate_write = 0;
+          data[i].nb_aborts_validate_commit = 0;
+          data[i].nb_aborts_invalid_memory = 0;
+          data[i].nb_aborts_double_write = 0;
+          data[i].max_retries = 0;
+          data[i].failures_because_contention = 0;
+          data[i].perf = perf::values();
+        }
+        events_before = counters::snapshot();
+      }
+      int run_ms = run < 0 ? warmup : duration;
+      memset(record, 0, sizeof(record));
+      if (rate > 0) {
+        for (int i = 0; i < nb_threads; i++) {
+          data[i].latency->clear();
+          data[i].service->clear();
+        }
+      }
 
-    printf("STARTING...\n");
-    struct timeval    start, end;
-    gettimeofday(&start, NULL);
-    if (duration > 0) {
-        nanosleep(&timeout, NULL);
-    } else {
-        sigset_t block_set;
-        sigemptyset(&block_set);
-        sigsuspend(&block_set);
-    }
+      // Access set from all threads
+      barrier_t         barrier;
+      barrier_init(&barrier, nb_threads + 1);
+      pthread_attr_t    attr;
+      pthread_attr_init(&attr);
+      pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+      stop = 0;
+      for (int i = 0; i < nb_threads; i++) {
+        data[i].barrier = &barrier;
+        if (pthread_create(&threads[i], &attr, test, (void *)(&data[i])) != 0) {
+          fprintf(stderr, "Error creating thread\n");
+          exit(1);
+        }
+      }
+      pthread_attr_destroy(&attr);
+
+      unsigned long ops_before = total_ops(data, nb_threads);
+
+      // Start threads
+      barrier_cross(&barrier);                                           
+
+      printf(run < 0 ? "WARMING UP...\n" : "STARTING run %d...\n", run + 1);
+      struct timeval    start, end;
+      gettimeofday(&start, NULL);
+      std::vector<double> timeline;
+      if (run_ms > 0) {
+          // sample throughput every TIMELINE_INTERVAL_MS
+          unsigned long last_ops = ops_before;
+          for (int elapsed = 0; elapsed < run_ms; elapsed += bench::TIMELINE_INTERVAL_MS) {
+              int step = std::min(bench::TIMELINE_INTERVAL_MS, run_ms - elapsed);
+              struct timespec timeout;
+              timeout.tv_sec =               step / 1000;
+              timeout.tv_nsec =              (step % 1000) * 1000000;
+              nanosleep(&timeout, NULL);
+              unsigned long ops = total_ops(data, nb_threads);
+              timeline.push_back((ops - last_ops) * 1000.0 / step);
+              last_ops = ops;
+          }
+      } else {
+          sigset_t block_set;
+          sigemptyset(&block_set);
+          sigsuspend(&block_set);
+      }
 
 #ifdef ICC
-    stop = 1;
+      stop = 1;
 #else
-    AO_store_full(&stop, 1);
+      AO_store_full(&stop, 1);
 #endif /* ICC */
 
-    stop = 1;
-    gettimeofday(&end, NULL);
-    printf("STOPPING...\n");
+      stop = 1;
+      gettimeofday(&end, NULL);
+      printf("STOPPING...\n");
     
-    // Wait for thread completion
-    for (i = 0; i < nb_threads; i++){
-        //printf("waiting thread %d end...\n", data[i].id);
-        if (pthread_join(threads[i], NULL) != 0) {
-            fprintf(stderr, "Error waiting for thread completion\n");
-            exit(1);
-        }
-        //printf("thread %d end!\n", data[i].id);
+      // Wait for thread completion
+      for (i = 0; i < nb_threads; i++){
+          //printf("waiting thread %d end...\n", data[i].id);
+          if (pthread_join(threads[i], NULL) != 0) {
+              fprintf(stderr, "Error waiting for thread completion\n");
+              exit(1);
+          }
+          //printf("thread %d end!\n", data[i].id);
+      }
+
+      if (run < 0)
+          continue;
+      unsigned long elapsed_ms = (end.tv_sec * 1000 + end.tv_usec / 1000) - (start.tv_sec * 1000 + start.tv_usec / 1000);
+      measured_ms += elapsed_ms;
+      run_throughput.push_back((total_ops(data, nb_threads) - ops_before) * 1000.0 / std::max(elapsed_ms, 1UL));
+      run_timeline.push_back(timeline);
+      if (rate > 0) {
+          // all threads, corrected for coordinated omission
+          bench::histogram latency, service;
+          for (int i = 0; i < nb_threads; i++) {
+              latency.merge(*data[i].latency);
+              service.merge(*data[i].service);
+          }
+          run_p50.push_back(latency.percentile(0.5) / 1000.0);
+          run_p90.push_back(latency.percentile(0.9) / 1000.0);
+          run_p99.push_back(latency.percentile(0.99) / 1000.0);
+          run_p999.push_back(latency.percentile(0.999) / 1000.0);
+          run_service_p99.push_back(service.percentile(0.99) / 1000.0);
+          printf("medium latency is %.1lfus\n90%% latency is %.1lfus\n99%% latency is %.1lfus\n"
+                 "99.9%% latency is %.1lfus\n99%% service time is %.1lfus\n",
+                 run_p50.back(), run_p90.back(), run_p99.back(), run_p999.back(), run_service_p99.back());
+          continue;
+      }
+#ifdef DETECT_LATENCY
+      double latency_50, latency_90, latency_99;
+      latency_percentiles(&latency_50, &latency_90, &latency_99);
+      printf("medium latency is %.1lfus\n90%% latency is %.1lfus\n99%% latency is %.1lfus\n", latency_50, latency_90, latency_99);
+      run_p50.push_back(latency_50);
+      run_p90.push_back(latency_90);
+      run_p99.push_back(latency_99);
+#endif
     }
 
-    duration =                    (end.tv_sec * 1000 + end.tv_usec / 1000) - (start.tv_sec * 1000 + start.tv_usec / 1000);
+    duration =                    measured_ms;
     unsigned long aborts =                      0;
     unsigned long aborts_locked_read =          0;
     unsigned long aborts_locked_write =         0;
@@ -660,6 +947,10 @@ int main(int argc, char **argv)
         if (max_retries < data[i].max_retries)
             max_retries = data[i].max_retries;
     }
+    perf::values run_perf;
+    for (int i = 0; i < nb_threads; i++)
+        run_perf += data[i].perf;
+    run_perf = run_perf.per_op(reads + updates);
     printf("Duration      : %d (ms)\n",          duration);
     printf("#txs          : %lu (%f / s)\n",     reads + updates, (reads + updates) * 1000.0 / duration);
 
@@ -687,15 +978,76 @@ int main(int argc, char **argv)
     printf("  #dup-w      : %lu (%f / s)\n",     aborts_double_write, aborts_double_write * 1000.0 / duration);
     printf("  #failures   : %lu\n",              failures_because_contention);
     printf("Max retries   : %lu\n",              max_retries);
+    printf("uTree events  :\n");
+    counters::values events = counters::since(events_before, counters::snapshot());
+    counters::print(events);
+
+    bench::summary throughput = bench::summarize(run_throughput);
+    printf("Throughput    : %f / s median, 95%% CI [%f, %f] over %d runs\n",
+           throughput.median, throughput.ci_low, throughput.ci_high, repetitions);
+    printf("Run hardware counters per op:\n");
+    perf::print(run_perf);
+
+    if (json_file != NULL) {
+        bench::json j(json_file);
+        j.begin_object();
+        j.key("config").begin_object()
+            .field("index", "utree")
+            .field("key_size", (int)sizeof(entry_key_t))
+            .field("persistence", persistent ? "persistent" : "volatile")
+            .field("threads", nb_threads)
+            .field("initial", initial)
+            .field("update", update)
+            .field("skew", zipf_theta)
+            .field("duration_ms", duration / repetitions)
+            .field("warmup_ms", warmup)
+            .field("repetitions", repetitions)
+            .field("arrivals", rate > 0 ? (poisson ? "poisson" : "fixed") : "closed")
+            .field("offered_rate", rate)
+            .end_object();
+        j.field("throughput", throughput);
+        j.field("latency_p50_us", bench::summarize(run_p50));
+        j.field("latency_p90_us", bench::summarize(run_p90));
+        j.field("latency_p99_us", bench::summarize(run_p99));
+        if (rate > 0) {
+            j.field("latency_p999_us", bench::summarize(run_p999));
+            j.field("service_p99_us", bench::summarize(run_service_p99));
+        }
+        j.key("perf_per_op").begin_object();
+        j.key("load");
+        perf::write(j, load_perf);
+        j.key("run");
+        perf::write(j, run_perf);
+        j.end_object();
+        if (!scan_results.empty()) {
+            j.key("parallel_scan").begin_array();
+            for (auto &r : scan_results)
+                j.begin_object().field("threads", r.first).field("rows_per_s", r.second).end_object();
+            j.end_array();
+        }
+        j.key("timeline").begin_array();
+        for (auto &t : run_timeline)
+            j.value(t);
+        j.end_array();
+        j.key("events").begin_object();
+        for (int e = 0; e < counters::NUM; e++)
+            j.field(counters::names[e], (unsigned long)events[e]);
+        j.end_object();
+        j.end_object();
+        fputc('\n', json_file);
+        fclose(json_file);
+    }
 
 #ifndef TLS
     pthread_key_delete(rng_seed_key);
 #endif /* ! TLS */
 
+    for (int i = 0; i < nb_threads; i++) {
+        delete data[i].latency;
+        delete data[i].service;
+    }
     free(threads);
     free(data);
 
     return 0;
 }
-
-
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <sys/mman.h>
+
+#include <atomic>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+
+/*
+ * DRAM page layouts, the P parameter of btree<T, K, L, P>.
+ *
+ * wide_pages is the FAST&FAIR page: an array of key/pointer entries, the
+ * pointer a full 8 bytes. compact_pages stores the keys and 32-bit handles in
+ * two arrays instead, 12 bytes an entry for 8-byte keys instead of 16 and
+ * every key still naturally aligned, so a page of the same size holds about
+ * a third more entries. A handle is either a page, numbered in a DRAM arena
+ * all compact pages are allocated from, or a list node (chunk slot), as the
+ * id of the 64 MB segment of address space it lies in and its 8-byte offset
+ * there, the way pm_ptr.h splits a link into pool id and offset. Segments get
+ * ids as the first node in each is encoded, so the nodes may lie anywhere
+ * (each thread's space, every pool) as long as they touch at most 255
+ * segments, 16 GB of them.
+ */
+struct wide_pages {
+    constexpr static bool compact = false;
+};
+
+struct compact_pages {
+    constexpr static bool compact = true;
+};
+
+namespace page_arena {
+
+constexpr uint32_t PAGE_TAG = 1U << 31;
+constexpr size_t GRAIN = 64;                                // pages are cache line aligned
+constexpr size_t ARENA_BYTES = (size_t)PAGE_TAG * GRAIN;    // 128 GB of address space
+constexpr int SEGMENT_SHIFT = 26;                           // 64 MB of list nodes
+constexpr int OFFSET_BITS = SEGMENT_SHIFT - 3;              // in 8 bytes
+constexpr uint32_t SEGMENTS = PAGE_TAG >> OFFSET_BITS;      // ids 1 to 255, 0 is null
+constexpr int ADDRESS_BITS = 47;                            // user space
+
+inline char *arena = nullptr;
+inline std::atomic<size_t> arena_used{0};
+inline std::once_flag arena_once;
+inline char *segment_base[SEGMENTS];
+inline std::atomic<uint8_t> segment_id[1ULL << (ADDRESS_BITS - SEGMENT_SHIFT)];  // 2 MB, by address
+inline uint32_t segments_used = 0;
+inline std::mutex segment_mtx;
+
+// Pages are never handed back, as in the rest of the tree.
+inline void *alloc(size_t size) {
+    std::call_once(arena_once, [] {
+        void *m = mmap(nullptr, ARENA_BYTES, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (m == MAP_FAILED) {
+            perror("page_arena: mmap");
+            exit(1);
+        }
+        arena = (char *)m;
+    });
+    size_t off = arena_used.fetch_add((size + GRAIN - 1) & ~(GRAIN - 1));
+    if (off + size > ARENA_BYTES) {
+        printf("page_arena: out of space for pages\n");
+        exit(1);
+    }
+    return arena + off;
+}
+
+// The id of the segment p lies in, given one if it has none yet.
+inline uint32_t segment_of(const char *p) {
+    uintptr_t s = (uintptr_t)p >> SEGMENT_SHIFT;
+    uint32_t id = segment_id[s].load(std::memory_order_acquire);
+    if (id != 0)
+        return id;
+    std::lock_guard<std::mutex> lock(segment_mtx);
+    id = segment_id[s].load(std::memory_order_relaxed);
+    if (id == 0) {
+        if (segments_used + 1 == SEGMENTS) {
+            printf("page_arena: list nodes span more than %u segments of 64 MB\n", SEGMENTS - 1);
+            exit(1);
+        }
+        id = ++segments_used;
+        segment_base[id] = (char *)(s << SEGMENT_SHIFT);
+        segment_id[s].store(id, std::memory_order_release);
+    }
+    return id;
+}
+
+inline uint32_t encode(const char *p) {
+    if (p == nullptr)
+        return 0;
+    if (p >= arena && p < arena + ARENA_BYTES)
+        return PAGE_TAG | (uint32_t)((p - arena) / GRAIN);
+    if ((uintptr_t)p >> ADDRESS_BITS != 0 || (uintptr_t)p % 8 != 0) {
+        printf("page_arena: %p is neither a page nor a list node\n", p);
+        exit(1);
+    }
+    uint32_t off = ((uintptr_t)p & ((1ULL << SEGMENT_SHIFT) - 1)) >> 3;
+    return segment_of(p) << OFFSET_BITS | off;
+}
+
+inline char *decode(uint32_t h) {
+    if (h == 0)
+        return nullptr;
+    if (h & PAGE_TAG)
+        return arena + (size_t)(h & ~PAGE_TAG) * GRAIN;
+    return segment_base[h >> OFFSET_BITS] + (size_t)(h & ((1U << OFFSET_BITS) - 1)) * 8;
+}
+
+// A record's pointer as a handle, read and written like the char * it replaces.
+class ref {
+    uint32_t h;
+
+public:
+    ref() = default;
+    ref(char *p) : h(encode(p)) {}
+    ref(std::nullptr_t) : h(0) {}
+    ref &operator=(char *p) {
+        h = encode(p);
+        return *this;
+    }
+    operator char *() const { return decode(h); }
+    template <typename U>
+    explicit operator U *() const { return (U *)decode(h); }
+};
+
+// The records of a compact page, records[i].key and records[i].ptr as before.
+template <typename K, size_t N>
+struct records {
+    K keys[N];
+    ref ptrs[N];
+
+    struct entry {
+        K &key;
+        ref &ptr;
+    };
+
+    records() {
+        for (size_t i = 0; i < N; ++i) {
+            keys[i] = {ULONG_MAX};
+            ptrs[i] = nullptr;
+        }
+    }
+
+    entry operator[](size_t i) { return {keys[i], ptrs[i]}; }
+    entry at(size_t i) {
+        if (i >= N) {
+            printf("page_arena: record %lu of %lu\n", i, N);
+            exit(1);
+        }
+        return {keys[i], ptrs[i]};
+    }
+};
+
+}  // namespace page_arena
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "utree.h"
+
+/*
+ * Range scan and aggregation over [lo, hi) with several threads. The range is
+ * cut at separator keys read from the DRAM inner pages (btree::partitionKeys)
+ * into a few pieces per worker, handed out through a shared index so a worker
+ * that drew a dense piece does not hold up the others. Each worker walks its
+ * pieces along the PM list into its own state, the states are merged once
+ * every worker is done. init is the identity of merge (e.g. a zero count),
+ * every worker and the result start from a copy of it:
+ *
+ *     visit(State &, const K &, const T &)   per key, in key order per piece
+ *     merge(State &into, const State &from)  per worker, in worker order
+ *
+ * With nodes, worker w runs on the CPUs of nodes[w % nodes.size()], so the
+ * workers spread over the sockets and build their state in local memory.
+ */
+namespace parallel {
+
+constexpr size_t PIECES_PER_WORKER = 4;
+
+template <typename State>
+struct alignas(64) worker_state {
+    State state;
+};
+
+template <typename T, typename K, typename L, typename P, typename State, typename Visit, typename Merge>
+State scan(btree<T, K, L, P> &bt, K lo, K hi, int workers, const State &init, Visit visit,
+           Merge merge, const std::vector<cpu_set_t> &nodes = {})
+{
+    if (workers < 1)
+        workers = 1;
+    std::vector<K> bounds = bt.partitionKeys(lo, hi, workers * PIECES_PER_WORKER);
+    bounds.insert(bounds.begin(), lo);
+    bounds.push_back(hi);
+    size_t pieces = bounds.size() - 1;
+
+    std::vector<worker_state<State>> states(workers, worker_state<State>{init});
+    std::atomic<size_t> next{0};
+    auto work = [&](int w) {
+        if (!nodes.empty())
+            pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &nodes[w % nodes.size()]);
+        State local = init;   // first touched on the worker's node
+        for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < pieces;)
+            bt.forEach(bounds[i], bounds[i + 1],
+                       [&](const K &k, const T &v) { visit(local, k, v); });
+        states[w].state = local;
+    };
+
+    std::vector<std::thread> threads;
+    for (int w = 0; w < workers; ++w)
+        threads.emplace_back(work, w);
+    for (auto &t : threads)
+        t.join();
+
+    State total = init;
+    for (auto &s : states)
+        merge(total, s.state);
+    return total;
+}
+
+}  // namespace parallel
@@ -0,0 +1,191 @@
+#pragma once
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+/*
+ * Hardware counters of the calling thread around a benchmark phase, read
+ * through perf_event_open. Events the CPU or the kernel settings do not allow
+ * are skipped; if none can be opened the group reports itself unavailable.
+ */
+namespace perf {
+
+enum event : int {
+    CYCLES,
+    INSTRUCTIONS,
+    LLC_MISSES,
+    DTLB_MISSES,
+    NODE_LOADS,     // loads served by a memory node (DRAM or PM)
+    NODE_STORES,
+    NUM
+};
+
+const char *const names[NUM] = {
+    "cycles", "instructions", "llc_misses", "dtlb_misses", "node_loads", "node_stores",
+};
+
+inline void describe(event e, perf_event_attr &attr) {
+    auto cache = [](uint64_t c, uint64_t op, uint64_t result) {
+        return c | (op << 8) | (result << 16);
+    };
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    switch (e) {
+    case CYCLES:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+    case INSTRUCTIONS:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+    case LLC_MISSES:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        break;
+    case DTLB_MISSES:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = cache(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ,
+                            PERF_COUNT_HW_CACHE_RESULT_MISS);
+        break;
+    case NODE_LOADS:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = cache(PERF_COUNT_HW_CACHE_NODE, PERF_COUNT_HW_CACHE_OP_READ,
+                            PERF_COUNT_HW_CACHE_RESULT_ACCESS);
+        break;
+    case NODE_STORES:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = cache(PERF_COUNT_HW_CACHE_NODE, PERF_COUNT_HW_CACHE_OP_WRITE,
+                            PERF_COUNT_HW_CACHE_RESULT_ACCESS);
+        break;
+    default:
+        break;
+    }
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+}
+
+struct values {
+    double v[NUM] = {};
+    bool valid[NUM] = {};
+
+    values &operator+=(const values &o) {
+        for (int i = 0; i < NUM; ++i) {
+            v[i] += o.v[i];
+            valid[i] = valid[i] || o.valid[i];
+        }
+        return *this;
+    }
+
+    values per_op(uint64_t ops) const {
+        values ret = *this;
+        for (int i = 0; i < NUM; ++i)
+            ret.v[i] = ops ? v[i] / ops : 0;
+        return ret;
+    }
+
+    bool any() const {
+        for (bool b : valid)
+            if (b)
+                return true;
+        return false;
+    }
+};
+
+/*
+ * The core events form one group so they are scheduled together and their
+ * ratios are exact. The memory node events are optional and often share
+ * counters with them, so they are opened on their own.
+ */
+class group {
+    int fds[NUM];
+    int leader = -1;
+
+    static bool in_group(int i) { return i < NODE_LOADS; }
+
+    void each_standalone(unsigned long request) {
+        for (int i = 0; i < NUM; ++i) {
+            if (!in_group(i) && fds[i] != -1)
+                ioctl(fds[i], request, 0);
+        }
+    }
+
+public:
+    group() {
+        for (int i = 0; i < NUM; ++i) {
+            perf_event_attr attr;
+            describe((event)i, attr);
+            fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, in_group(i) ? leader : -1, 0);
+            if (in_group(i) && leader == -1)
+                leader = fds[i];
+        }
+    }
+
+    ~group() {
+        for (int fd : fds)
+            if (fd != -1)
+                close(fd);
+    }
+
+    group(const group &) = delete;
+    group &operator=(const group &) = delete;
+
+    void start() {
+        if (leader != -1) {
+            ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+        each_standalone(PERF_EVENT_IOC_RESET);
+        each_standalone(PERF_EVENT_IOC_ENABLE);
+    }
+
+    // Counts since start(), scaled up if the kernel multiplexed the counters.
+    values stop() {
+        values ret;
+        if (leader != -1)
+            ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        each_standalone(PERF_EVENT_IOC_DISABLE);
+        for (int i = 0; i < NUM; ++i) {
+            uint64_t buf[3];    // value, time enabled, time running
+            if (fds[i] == -1 || read(fds[i], buf, sizeof(buf)) != sizeof(buf) || buf[2] == 0)
+                continue;
+            ret.v[i] = buf[0] * ((double)buf[1] / buf[2]);
+            ret.valid[i] = true;
+        }
+        return ret;
+    }
+};
+
+template <typename Json>
+void write(Json &j, const values &v) {
+    j.begin_object();
+    for (int i = 0; i < NUM; ++i) {
+        if (v.valid[i])
+            j.field(names[i], v.v[i]);
+    }
+    j.end_object();
+}
+
+// One line per event, e.g. per op values next to the latency numbers.
+inline void print(const values &v, FILE *out = stdout) {
+    if (!v.any()) {
+        fprintf(out, "  hardware counters unavailable\n");
+        return;
+    }
+    for (int i = 0; i < NUM; ++i) {
+        if (v.valid[i])
+            fprintf(out, "  %-24s: %.2f\n", names[i], v.v[i]);
+    }
+    if (v.valid[CYCLES] && v.valid[INSTRUCTIONS] && v.v[CYCLES] > 0)
+        fprintf(out, "  %-24s: %.2f\n", "ipc", v.v[INSTRUCTIONS] / v.v[CYCLES]);
+}
+
+} // namespace perf
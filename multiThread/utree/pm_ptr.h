@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <type_traits>
+
+/*
+ * Pool relative PM pointers. With -DUSE_RELATIVE_PTR a PM link is stored as
+ * a pool id in the top 16 bits and the byte offset into that pool in the low
+ * 48, so a pool can be mapped at a different address on every run (or each
+ * NUMA node's pool wherever mmap puts it) and the list still reads. The pools
+ * are registered with attach() under ids that stay the same across runs; id 0
+ * is not a pool, which makes 0 the null pointer. Turning a link into an
+ * address is one table load and an add, turning an address into a link looks
+ * the pool up among the attached ones.
+ *
+ * Without the flag pm::link<T> is a plain T * and the helpers are no-ops, so
+ * the tree code is written once against link<T> and cas().
+ */
+namespace pm {
+
+constexpr int OFFSET_BITS = 48;
+constexpr uint64_t OFFSET_MASK = (1ULL << OFFSET_BITS) - 1;
+constexpr int MAX_POOLS = 16;
+
+struct pool {
+    char *base;
+    uint64_t size;
+};
+
+inline pool pools[MAX_POOLS + 1];   // by id, [0] unused
+inline int last_pool = 0;           // highest id attached
+
+// Register the pool mapped at base, before any link into it is read or written.
+inline void attach(int id, char *base, uint64_t size) {
+    if (id < 1 || id > MAX_POOLS || size > OFFSET_MASK) {
+        printf("pm: cannot attach pool %d of %lu bytes\n", id, size);
+        exit(1);
+    }
+    pools[id] = {base, size};
+    if (id > last_pool)
+        last_pool = id;
+}
+
+inline int pool_of(const void *p) {
+    for (int id = 1; id <= last_pool; ++id) {
+        if ((const char *)p >= pools[id].base && (const char *)p < pools[id].base + pools[id].size)
+            return id;
+    }
+    printf("pm: %p is not in an attached pool\n", p);
+    exit(1);
+}
+
+inline uint64_t to_rel(const void *p) {
+    if (p == nullptr)
+        return 0;
+    int id = pool_of(p);
+    return ((uint64_t)id << OFFSET_BITS) | (uint64_t)((const char *)p - pools[id].base);
+}
+
+inline char *to_abs(uint64_t r) {
+    return r == 0 ? nullptr : pools[r >> OFFSET_BITS].base + (r & OFFSET_MASK);
+}
+
+// A PM link as a pool id and offset, read and written like a T *.
+template <typename T>
+class rel_ptr {
+    uint64_t raw;
+
+public:
+    rel_ptr() = default;
+    rel_ptr(T *p) : raw(to_rel(p)) {}
+    rel_ptr &operator=(T *p) {
+        raw = to_rel(p);
+        return *this;
+    }
+    operator T *() const { return (T *)to_abs(raw); }
+    T *operator->() const { return (T *)to_abs(raw); }
+    uint64_t bits() const { return raw; }
+
+    bool cas(T *expected, T *desired) {
+        return __sync_bool_compare_and_swap(&raw, to_rel(expected), to_rel(desired));
+    }
+};
+
+#ifdef USE_RELATIVE_PTR
+template <typename T>
+using link = rel_ptr<T>;
+#else
+template <typename T>
+using link = T *;
+#endif
+
+// The link's type alone picks T, so nullptr passes as either argument.
+template <typename T>
+inline bool cas(T **p, std::common_type_t<T *> expected, std::common_type_t<T *> desired) {
+    return __sync_bool_compare_and_swap(p, expected, desired);
+}
+
+template <typename T>
+inline bool cas(rel_ptr<T> *p, std::common_type_t<T *> expected, std::common_type_t<T *> desired) {
+    return p->cas(expected, desired);
+}
+
+}  // namespace pm
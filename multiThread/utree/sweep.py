@@ -0,0 +1,69 @@
+#!/usr/bin/python3
+
+# Runs main-gu-zipfian over the cross product of the sweep lists below and
+# collects the per-configuration JSON results into one file.
+
+import itertools
+import json
+import subprocess
+import sys
+import tempfile
+import time
+
+SWEEPS = {
+    "keysize": [1, 2, 4],
+    "persistence": ["persistent", "volatile"],  # volatile: DRAM-only build
+    "threads": [1, 4, 8, 16, 20],
+    "skew": [0.0, 0.9, 0.99],
+    "update": [5, 50, 100],
+}
+INITIAL = 10000000
+DURATION_MS = 5000
+WARMUP_MS = 1000
+REPETITIONS = 5
+
+
+def compile(keysize, persistence):
+    subprocess.run([
+        "g++", "-std=c++17", "-m64", "-D_REENTRANT", "-fno-strict-aliasing",
+        "-I./atomic_ops", "-DINTEL", "-Wno-unused-value", "-Wno-format",
+        "-O2", "-o", "./main-gu-zipfian", "main-gu-zipfian.c", "-lpmemobj", "-lpmem",
+        "-lpthread", f"-DKEYSIZE={keysize}"]
+        + (["-DUSE_VOLATILE"] if persistence == "volatile" else []), check=True)
+
+
+def run(threads, skew, update):
+    with tempfile.NamedTemporaryFile(suffix=".json") as out:
+        try:
+            subprocess.run([
+                "./main-gu-zipfian", "-t", str(threads), "-z", str(skew), "-u", str(update),
+                "-i", str(INITIAL), "-d", str(DURATION_MS), "-W", str(WARMUP_MS),
+                "-R", str(REPETITIONS), "-f", "0", "-J", out.name],
+                check=True, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+        except subprocess.CalledProcessError as error:
+            print("Status : FAIL", error.returncode)
+            print(f'stderr: {error.stderr.decode(sys.getfilesystemencoding())}')
+            return None
+        return json.load(out)
+
+
+def main():
+    results = []
+    for keysize, persistence in itertools.product(SWEEPS["keysize"], SWEEPS["persistence"]):
+        compile(keysize, persistence)
+        for threads, skew, update in itertools.product(
+                SWEEPS["threads"], SWEEPS["skew"], SWEEPS["update"]):
+            print(f"keysize {keysize} {persistence} threads {threads} skew {skew} update {update}")
+            res = run(threads, skew, update)
+            if res is not None:
+                results.append(res)
+                print(f"    {res['throughput']['median']:.0f} ops/s, "
+                      f"95% CI {res['throughput']['ci95']}")
+            time.sleep(3)
+    timestamp = time.strftime("%Y%m%d-%H%M%S")
+    with open(f'sweep-{timestamp}.json', 'w') as f:
+        json.dump(results, f, indent=1)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,505 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "utree.h"
+
+/*
+ * A table of rows with one primary and any number of secondary indexes. Each
+ * row is stored once, in PM of its own, and the value of its list node in a
+ * primary btree keyed by the row's primary key is a link to it. A write puts
+ * the whole row somewhere new and flushes it before the link swings over, so
+ * neither a crash nor a reader ever sees part of one row and part of another;
+ * replaced rows are not reused. Every secondary index is a btree of its own,
+ * from the index key to the row's primary key and the columns the index
+ * covers, so nothing points into the primary's list and an index-only scan
+ * never reads a row.
+ *
+ * An index is described by a type with
+ *
+ *     using key_type = ...;                  // a btree key
+ *     using cover_type = ...;                // the covered columns, table_index::none if none
+ *     static key_type key(const Row &);
+ *     static cover_type cover(const Row &);
+ *
+ * table_index::column<&Row::field> indexes one field and covers nothing. The
+ * primary index's cover is not used. Secondary keys are unique like primary
+ * keys: an index on a column that repeats takes the primary key into its key.
+ *
+ * Writers of the same primary or secondary key are serialized by striped
+ * locks, readers take none. A write notes its primary key and the index keys
+ * of the row before and after in a PM intent slot before touching any tree
+ * and clears it last, so recover() only has to look at the rows of the slots
+ * still set: it drops their index entries the row no longer has and writes
+ * the ones it has. Lookups through an index check the entry against the row;
+ * scans do not, and show a row being moved to another index key under both.
+ */
+namespace table_index {
+
+struct none {};
+
+template <auto Column>
+struct column;
+
+template <typename Row, typename Key, Key Row::*Column>
+struct column<Column> {
+    using key_type = Key;
+    using cover_type = none;
+    static Key key(const Row &row) { return row.*Column; }
+    static none cover(const Row &) { return {}; }
+};
+
+// The value of a secondary index.
+template <typename PK, typename Cover>
+struct entry {
+    PK pk;
+    Cover cover;
+};
+
+// Persistent, one per writer running at a time.
+template <typename PK, typename Keys>
+struct alignas(64) intent {
+    uint64_t active;        // set after the rest is flushed, cleared when the write is done
+    PK pk;
+    Keys before, after;     // index keys of the row before and after the write
+    uint8_t had_row, has_row;
+};
+
+constexpr uint64_t MANIFEST_MAGIC = 0x3142544545525475ULL;  // "uTREETB1"
+
+struct manifest {
+    uint64_t magic;
+    uint32_t indexes;
+    uint32_t relative;
+    int64_t log;            // intent slots, offset from pm_base or pm::rel_ptr bits
+};
+
+}  // namespace table_index
+
+template <typename Row, typename Primary, typename... Indexes>
+class table {
+public:
+    using PK = typename Primary::key_type;
+    using row_ref = pm::link<Row>;
+    using keys = std::tuple<typename Indexes::key_type...>;
+    template <size_t I>
+    using index_t = std::tuple_element_t<I, std::tuple<Indexes...>>;
+    template <size_t I>
+    using entry_t = table_index::entry<PK, typename index_t<I>::cover_type>;
+    template <size_t I>
+    using tree_t = btree<entry_t<I>, typename index_t<I>::key_type>;
+    static constexpr size_t INDEXES = sizeof...(Indexes);
+
+    table();
+#ifdef USE_CHECKPOINT
+    table(const std::string &dir, char *pm_base);  // Restart from checkpoint(dir), then recover()
+    void checkpoint(const std::string &dir, bool quiesced = false);
+#endif
+    bool insert(const Row &);           // False if its primary or a secondary key is taken
+    bool update(const Row &);           // The row with its primary key, false if there is none
+    bool erase(PK);                     // False if there is no such row
+    const Row *get(PK);                 // The row in PM, nullptr if none
+    std::vector<Row> scan(PK, size_t);  // Like btree::scan() along the primary key
+    template <size_t I>
+    const Row *getBy(typename index_t<I>::key_type);
+    template <size_t I>
+    std::vector<Row> scanBy(typename index_t<I>::key_type, size_t);  // Like btree::scan() along index I
+    template <size_t I, typename F>
+    void forEachBy(typename index_t<I>::key_type lo, typename index_t<I>::key_type hi, F visit);
+    size_t recover();                   // Repair the indexes of interrupted writes, returns their number
+
+    btree<row_ref, PK> &primary() { return *rows; }
+    template <size_t I>
+    tree_t<I> &index() { return *std::get<I>(indexes); }
+
+private:
+    static constexpr size_t MAX_WRITERS = 256;
+    static constexpr size_t STRIPES = 1024;
+    static constexpr size_t MAX_HELD = 2 * INDEXES + 1;
+    using intent_t = table_index::intent<PK, keys>;
+
+    template <typename I>
+    struct tree_of;
+    template <size_t... I>
+    struct tree_of<std::index_sequence<I...>> {
+        using type = std::tuple<std::unique_ptr<tree_t<I>>...>;
+    };
+
+    std::unique_ptr<btree<row_ref, PK>> rows;
+    typename tree_of<std::index_sequence_for<Indexes...>>::type indexes;
+    intent_t *log;
+    std::atomic<bool> busy[MAX_WRITERS] = {};
+    std::mutex stripes[STRIPES];
+#ifdef USE_CHECKPOINT
+    char *pm_base;
+#endif
+
+    struct held {
+        std::array<size_t, MAX_HELD> s;
+        size_t n = 0;
+    };
+
+    template <typename F>
+    static void each(F &&f) {
+        eachOf(f, std::index_sequence_for<Indexes...>{});
+    }
+    template <typename F, size_t... I>
+    static void eachOf(F &f, std::index_sequence<I...>) {
+        (f(std::integral_constant<size_t, I>{}), ...);
+    }
+
+    template <typename K>
+    static size_t stripe(const K &key, uint64_t seed) {
+        uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+        for (size_t i = 0; i < sizeof(K); ++i)
+            h = (h ^ ((const unsigned char *)&key)[i]) * 0x100000001b3ULL;
+        return h % STRIPES;
+    }
+
+    static keys keysOf(const Row &row) { return keys{Indexes::key(row)...}; }
+    static const Row *deref(const row_ref *r) { return r == nullptr ? nullptr : (Row *)*r; }
+    const Row *find(PK pk) { return deref(rows->search(pk)); }
+    static Row *store(const Row &);
+    void lock(held &, PK, const keys *, const keys *);
+    void unlock(held &);
+    intent_t *beginWrite(PK, const keys *before, const keys *after);
+    void endWrite(intent_t *);
+    template <size_t I>
+    bool taken(const typename index_t<I>::key_type &);
+    template <size_t I>
+    void drop(const typename index_t<I>::key_type &, PK);
+    void repair(const intent_t &);
+};
+
+template <typename Row, typename Primary, typename... Indexes>
+table<Row, Primary, Indexes...>::table() {
+    rows = std::make_unique<btree<row_ref, PK>>();
+    each([&](auto i) { std::get<i>(indexes) = std::make_unique<tree_t<i>>(); });
+    log = (intent_t *)reserve_aligned(sizeof(intent_t) * MAX_WRITERS, alignof(intent_t));
+    memset((char *)log, 0, sizeof(intent_t) * MAX_WRITERS);
+    clflush((char *)log, sizeof(intent_t) * MAX_WRITERS);
+#ifdef USE_CHECKPOINT
+    pm_base = start_addr;
+#endif
+}
+
+// Stripes in ascending order, so writers never wait on each other in a circle.
+template <typename Row, typename Primary, typename... Indexes>
+void table<Row, Primary, Indexes...>::lock(held &h, PK pk, const keys *a, const keys *b) {
+    h.n = 0;
+    h.s[h.n++] = stripe(pk, 0);
+    for (auto k : {a, b}) {
+        if (k != nullptr)
+            each([&](auto i) { h.s[h.n++] = stripe(std::get<i>(*k), i + 1); });
+    }
+    std::sort(h.s.begin(), h.s.begin() + h.n);
+    h.n = std::unique(h.s.begin(), h.s.begin() + h.n) - h.s.begin();
+    for (size_t i = 0; i < h.n; ++i)
+        stripes[h.s[i]].lock();
+}
+
+template <typename Row, typename Primary, typename... Indexes>
+void table<Row, Primary, Indexes...>::unlock(held &h) {
+    for (size_t i = h.n; i-- > 0;)
+        stripes[h.s[i]].unlock();
+}
+
+// A copy of row in the calling thread's space, flushed before anything links it.
+template <typename Row, typename Primary, typename... Indexes>
+Row *table<Row, Primary, Indexes...>::store(const Row &row) {
+    auto r = alloc<Row>();
+    *r = row;
+    clflush((char *)r, sizeof(Row));
+    return r;
+}
+
+template <typename Row, typename Primary, typename... Indexes>
+typename table<Row, Primary, Indexes...>::intent_t *
+table<Row, Primary, Indexes...>::beginWrite(PK pk, const keys *before, const keys *after) {
+    size_t i = std::hash<std::thread::id>()(std::this_thread::get_id()) % MAX_WRITERS;
+    for (bool expected = false; !busy[i].compare_exchange_weak(expected, true); expected = false) {
+        if (++i == MAX_WRITERS) {
+            i = 0;
+            std::this_thread::yield();
+        }
+    }
+    intent_t *t = &log[i];
+    t->pk = pk;
+    t->had_row = before != nullptr;
+    t->has_row = after != nullptr;
+    if (before != nullptr)
+        t->before = *before;
+    if (after != nullptr)
+        t->after = *after;
+    clflush((char *)t, sizeof(intent_t));
+    t->active = 1;
+    clflush((char *)&t->active, sizeof(uint64_t));
+    return t;
+}
+
+template <typename Row, typename Primary, typename... Indexes>
+void table<Row, Primary, Indexes...>::endWrite(intent_t *t) {
+    t->active = 0;
+    clflush((char *)&t->active, sizeof(uint64_t));
+    busy[t - log].store(false, std::memory_order_release);
+}
+
+// An entry only counts if its row still has the key, a leftover does not.
+template <typename Row, typename Primary, typename... Indexes>
+template <size_t I>
+bool table<Row, Primary, Indexes...>::taken(const typename index_t<I>::key_type &key) {
+    auto e = index<I>().search(key);
+    if (e == nullptr)
+        return false;
+    auto row = find(e->pk);
+    return row != nullptr && index_t<I>::key(*row) == key;
+}
+
+template <typename Row, typename Primary, typename... Indexes>
+template <size_t I>
+void table<Row, Primary, Indexes...>::drop(const typename index_t<I>::key_type &key, PK pk) {
+    auto e = index<I>().search(key);
+    if (e != nullptr && e->pk == pk)
+        index<I>().remove(key);
+}
+
+template <typename Row, typename Primary, typename... Indexes>
+bool table<Row, Primary, Indexes...>::insert(const Row &row) {
+    PK pk = Primary::key(row);
+    keys after = keysOf(row);
+    held h;
+    lock(h, pk, &after, nullptr);
+    bool ok = find(pk) == nullptr;
+    each([&](auto i) { ok = ok && !taken<i>(std::get<i>(after)); });
+    if (ok) {
+        auto t = beginWrite(pk, nullptr, &after);
+        rows->insert(pk, store(row));
+        each([&](auto i) { index<i>().insert(std::get<i>(after), entry_t<i>{pk, index_t<i>::cover(row)}); });
+        endWrite(t);
+    }
+    unlock(h);
+    return ok;
+}
+
+/*
+ * New index entries go in before the link swings to the new row and the old
+ * ones come out after, so a lookup by either key finds the row throughout.
+ */
+template <typename Row, typename Primary, typename... Indexes>
+bool table<Row, Primary, Indexes...>::update(const Row &row) {
+    PK pk = Primary::key(row);
+    keys after = keysOf(row), before;
+    held h;
+    while (true) {
+        auto old = find(pk);
+        if (old == nullptr)
+            return false;
+        before = keysOf(*old);
+        lock(h, pk, &before, &after);
+        // The keys locked must still be the row's, else lock those instead.
+        old = find(pk);
+        if (old != nullptr && keysOf(*old) == before)
+            break;
+        unlock(h);
+    }
+    bool ok = true;
+    each([&](auto i) {
+        ok = ok && (std::get<i>(before) == std::get<i>(after) || !taken<i>(std::get<i>(after)));
+    });
+    if (ok) {
+        auto t = beginWrite(pk, &before, &after);
+        each([&](auto i) {
+            if (!(std::get<i>(before) == std::get<i>(after)))
+                index<i>().insert(std::get<i>(after), entry_t<i>{pk, index_t<i>::cover(row)});
+        });
+        rows->insert(pk, store(row));
+        each([&](auto i) {
+            if (!(std::get<i>(before) == std::get<i>(after)))
+                drop<i>(std::get<i>(before), pk);
+            else if constexpr (!std::is_empty_v<typename index_t<i>::cover_type>)
+                index<i>().insert(std::get<i>(after), entry_t<i>{pk, index_t<i>::cover(row)});
+        });
+        endWrite(t);
+    }
+    unlock(h);
+    return ok;
+}
+
+template <typename Row, typename Primary, typename... Indexes>
+bool table<Row, Primary, Indexes...>::erase(PK pk) {
+    keys before;
+    held h;
+    while (true) {
+        auto old = find(pk);
+        if (old == nullptr)
+            return false;
+        before = keysOf(*old);
+        lock(h, pk, &before, nullptr);
+        old = find(pk);
+        if (old != nullptr && keysOf(*old) == before)
+            break;
+        unlock(h);
+    }
+    auto t = beginWrite(pk, &before, nullptr);
+    each([&](auto i) { drop<i>(std::get<i>(before), pk); });
+    rows->remove(pk);
+    endWrite(t);
+    unlock(h);
+    return true;
+}
+
+template <typename Row, typename Primary, typename... Indexes>
+const Row *table<Row, Primary, Indexes...>::get(PK pk) {
+    return find(pk);
+}
+
+template <typename Row, typename Primary, typename... Indexes>
+std::vector<Row> table<Row, Primary, Indexes...>::scan(PK pk, size_t size) {
+    std::vector<Row> result;
+    for (auto &r : rows->scan(pk, size))
+        result.push_back(*(Row *)r);
+    return result;
+}
+
+template <typename Row, typename Primary, typename... Indexes>
+template <size_t I>
+const Row *table<Row, Primary, Indexes...>::getBy(typename index_t<I>::key_type key) {
+    auto e = index<I>().search(key);
+    if (e == nullptr)
+        return nullptr;
+    auto row = find(e->pk);
+    return row != nullptr && index_t<I>::key(*row) == key ? row : nullptr;
+}
+
+// Rows whose entry has no row behind it (a write in flight) are left out.
+template <typename Row, typename Primary, typename... Indexes>
+template <size_t I>
+std::vector<Row> table<Row, Primary, Indexes...>::scanBy(typename index_t<I>::key_type key, size_t size) {
+    std::vector<Row> result;
+    for (auto &e : index<I>().scan(key, size)) {
+        if (auto row = find(e.pk))
+            result.push_back(*row);
+    }
+    return result;
+}
+
+// visit(key, pk, cover) for the index keys in [lo, hi), from the index alone.
+template <typename Row, typename Primary, typename... Indexes>
+template <size_t I, typename F>
+void table<Row, Primary, Indexes...>::forEachBy(typename index_t<I>::key_type lo, typename index_t<I>::key_type hi,
+                                                 F visit) {
+    index<I>().forEach(lo, hi, [&](const typename index_t<I>::key_type &k, const entry_t<I> &e) {
+        visit(k, e.pk, e.cover);
+    });
+}
+
+// Makes every index agree with the row as it is now, whichever step the write reached.
+template <typename Row, typename Primary, typename... Indexes>
+void table<Row, Primary, Indexes...>::repair(const intent_t &t) {
+    auto found = find(t.pk);
+    Row row;
+    if (found != nullptr)
+        row = *found;
+    each([&](auto i) {
+        for (auto k : {t.had_row ? &t.before : nullptr, t.has_row ? &t.after : nullptr}) {
+            if (k != nullptr && (found == nullptr || !(index_t<i>::key(row) == std::get<i>(*k))))
+                drop<i>(std::get<i>(*k), t.pk);
+        }
+        if (found != nullptr)
+            index<i>().insert(index_t<i>::key(row), entry_t<i>{t.pk, index_t<i>::cover(row)});
+    });
+}
+
+// Single threaded, before the table is used.
+template <typename Row, typename Primary, typename... Indexes>
+size_t table<Row, Primary, Indexes...>::recover() {
+    size_t repaired = 0;
+    for (size_t i = 0; i < MAX_WRITERS; ++i) {
+        if (!log[i].active)
+            continue;
+        repair(log[i]);
+        log[i].active = 0;
+        clflush((char *)&log[i].active, sizeof(uint64_t));
+        ++repaired;
+    }
+    return repaired;
+}
+
+#ifdef USE_CHECKPOINT
+/*
+ * One image per tree in dir (primary, index0, index1, ...) and a manifest
+ * saying where the intent slots are. The images need not agree with each
+ * other: each tree restarts from its own list, and recover() settles the
+ * writes that were running.
+ */
+template <typename Row, typename Primary, typename... Indexes>
+void table<Row, Primary, Indexes...>::checkpoint(const std::string &dir, bool quiesced) {
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        printf("table: cannot create %s\n", dir.c_str());
+        exit(1);
+    }
+    rows->checkpoint((dir + "/primary").c_str(), quiesced);
+    each([&](auto i) { index<i>().checkpoint((dir + "/index" + std::to_string(i)).c_str(), quiesced); });
+    table_index::manifest m{};
+    m.magic = table_index::MANIFEST_MAGIC;
+    m.indexes = INDEXES;
+#ifdef USE_RELATIVE_PTR
+    m.relative = 1;
+    m.log = pm::to_rel(log);
+#else
+    m.log = (char *)log - pm_base;
+#endif
+    auto path = dir + "/table", tmp = path + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    bool ok = f != nullptr && fwrite(&m, sizeof(m), 1, f) == 1 && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = f != nullptr && fclose(f) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        printf("table: cannot write %s\n", path.c_str());
+        exit(1);
+    }
+}
+
+template <typename Row, typename Primary, typename... Indexes>
+table<Row, Primary, Indexes...>::table(const std::string &dir, char *base) : pm_base(base) {
+    table_index::manifest m{};
+    auto path = dir + "/table";
+    FILE *f = fopen(path.c_str(), "rb");
+    bool ok = f != nullptr && fread(&m, sizeof(m), 1, f) == 1;
+    if (f != nullptr)
+        fclose(f);
+#ifdef USE_RELATIVE_PTR
+    constexpr uint32_t relative = 1;
+#else
+    constexpr uint32_t relative = 0;
+#endif
+    if (!ok || m.magic != table_index::MANIFEST_MAGIC || m.indexes != INDEXES || m.relative != relative) {
+        printf("table: %s is not a checkpoint of this table\n", dir.c_str());
+        exit(1);
+    }
+    rows = std::make_unique<btree<row_ref, PK>>((dir + "/primary").c_str(), base);
+    each([&](auto i) {
+        std::get<i>(indexes) = std::make_unique<tree_t<i>>((dir + "/index" + std::to_string(i)).c_str(), base);
+    });
+#ifdef USE_RELATIVE_PTR
+    log = (intent_t *)pm::to_abs(m.log);
+#else
+    log = (intent_t *)(base + m.log);
+#endif
+    recover();
+}
+#endif
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+
+/*
+ * Structure statistics of one tree, maintained incrementally by the writers so
+ * that polling them costs a pass over a few shards instead of a tree walk.
+ */
+struct tree_stats {
+    constexpr static int MAX_LEVELS = 32;
+
+    uint64_t pages[MAX_LEVELS];     // DRAM pages per level, 0 = leaves
+    uint64_t total_pages;
+    uint64_t dram_bytes;
+    uint64_t list_nodes;            // live shadow list nodes, without the head
+    uint64_t pm_bytes_allocated;    // list nodes ever allocated, incl. overwritten ones
+    uint64_t pm_bytes_live;
+    int height;
+    double avg_leaf_fill;           // keys / leaf slots
+
+    void print(FILE *out = stdout) const {
+        fprintf(out, "  height                  : %d\n", height);
+        for (int i = height - 1; i >= 0; --i)
+            fprintf(out, "  pages at level %-2d       : %lu\n", i, (unsigned long)pages[i]);
+        fprintf(out, "  dram_bytes              : %lu\n", (unsigned long)dram_bytes);
+        fprintf(out, "  list_nodes              : %lu\n", (unsigned long)list_nodes);
+        fprintf(out, "  pm_bytes_allocated      : %lu\n", (unsigned long)pm_bytes_allocated);
+        fprintf(out, "  pm_bytes_live           : %lu\n", (unsigned long)pm_bytes_live);
+        fprintf(out, "  avg_leaf_fill           : %.3f\n", avg_leaf_fill);
+    }
+};
+
+/*
+ * Signed counters split over cache-line sized shards. A thread always updates
+ * the same shard, so writers on different cores rarely share a line.
+ */
+class stat_shards {
+public:
+    enum field : int {
+        LIST_NODES,
+        PM_ALLOCATED,
+        LEVEL_PAGES,                                    // one per level from here on
+        NUM = LEVEL_PAGES + tree_stats::MAX_LEVELS
+    };
+
+private:
+    constexpr static int SHARDS = 64;
+
+    struct alignas(64) shard {
+        std::atomic<int64_t> v[NUM];
+    };
+
+    shard shards[SHARDS];
+
+    static int my_shard() {
+        static std::atomic<int> next{0};
+        static thread_local int id = next.fetch_add(1) % SHARDS;
+        return id;
+    }
+
+public:
+    stat_shards() {
+        for (auto &s : shards)
+            for (auto &x : s.v)
+                x.store(0, std::memory_order_relaxed);
+    }
+
+    void add(int f, int64_t n = 1) {
+        shards[my_shard()].v[f].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    int64_t sum(int f) const {
+        int64_t ret = 0;
+        for (auto &s : shards)
+            ret += s.v[f].load(std::memory_order_relaxed);
+        return ret;
+    }
+};
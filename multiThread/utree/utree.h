@@ -1,5 +1,8 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
 #include <climits>
 #include <fstream>
@@ -8,6 +11,15 @@
 #ifdef USE_PMDK
 #include <libpmemobj.h>
 #endif
+#if defined(USE_VOLATILE) && defined(USE_PMDK)
+#error "USE_VOLATILE keeps the list in DRAM, it cannot be combined with USE_PMDK"
+#endif
+#if defined(USE_RELATIVE_PTR) && defined(USE_PMDK)
+#error "USE_RELATIVE_PTR needs the list in the attached pools, not in a PMDK pool"
+#endif
+#if defined(USE_SNAPSHOTS) && (defined(USE_CHECKPOINT) || defined(USE_ORDER_STATS) || defined(USE_DELTA_BUFFER))
+#error "USE_SNAPSHOTS keeps removed keys in the list until reclaimVersions(): not with checkpoints, order statistics or the delta buffer"
+#endif
 #include <cmath>
 #include <mutex>
 #include <cstdint>
@@ -17,10 +29,42 @@
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
+#include <memory>
+#include <thread>
 #include <vector>
+#ifdef USE_ASYNC_SPLIT
+#include <condition_variable>
+#include <deque>
+#include <thread>
+#endif
 // #include <gperftools/profiler.h>
+#include "counters.h"
+#include "tree_stats.h"
+#include "list_layout.h"
+#include "pm_ptr.h"
+#include "page_layout.h"
+#ifdef USE_HASH_INDEX
+#include "hash_index.h"
+#endif
+#if defined(USE_LIST_COMPACTION) || defined(USE_SNAPSHOTS)
+#include "epoch.h"
+#endif
+#ifdef USE_RELATIVE_PTR
+#include "attach.h"
+#endif
+#ifdef USE_CHECKPOINT
+#include <condition_variable>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include "checkpoint.h"
+#endif
 
 #define CACHE_LINE_SIZE 64
+// pages remember the separator they were split off at
+#if defined(USE_FINGER_HINT) || defined(USE_ORDER_STATS) || defined(USE_CHECKPOINT) || defined(USE_ASYNC_SPLIT)
+#define UTREE_LOW_FENCE
+#endif
 #define IS_FORWARD(c) (c % 2 == 0)
 
 #ifndef KEYSIZE
@@ -36,6 +80,8 @@ const uint64_t SPACE_PER_THREAD = 35ULL * 1024ULL * 1024ULL * 1024ULL;
 const uint64_t SPACE_OF_MAIN_THREAD = 35ULL * 1024ULL * 1024ULL * 1024ULL;
 extern __thread char *start_addr;
 extern __thread char *curr_addr;
+// end of the space handed to a helper thread by use_space(), nullptr for workers
+inline thread_local char *end_addr = nullptr;
 
 using namespace std;
 
@@ -44,9 +90,24 @@ inline void mfence()
     asm volatile("mfence":::"memory");
 }
 
+/*
+ * With -DUSE_VOLATILE the tree is a plain in-memory index: the caller backs
+ * the thread spaces with DRAM instead of PM and nothing is flushed. The
+ * concurrency protocol is unchanged.
+ */
+#ifdef USE_VOLATILE
+constexpr bool persistent = false;
+#else
+constexpr bool persistent = true;
+#endif
+
 inline void clflush(char *data, int len)
 {
+    if (!persistent)
+        return;
     volatile char *ptr = (char *)((unsigned long)data &~(CACHE_LINE_SIZE-1));
+    counters::add(counters::FLUSH);
+    counters::add(counters::FLUSH_LINES, (data + len - ptr + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE);
     mfence();
     for(; ptr<data+len; ptr+=CACHE_LINE_SIZE){
         asm volatile(".byte 0x66; clflush %0" : "+m" (*(volatile char *)ptr));
@@ -54,20 +115,26 @@ inline void clflush(char *data, int len)
     mfence();
 }
 
-template <typename T = int64_t>
+template <typename T = int64_t, typename K = entry_key_t>
 struct list_node_t {
     T value;
-    entry_key_t key;
-    bool isUpdate;
-    bool isDelete;
-    struct list_node_t *next;
+    K key;
+    bool isUpdate;      // being moved, list writers retry
+    bool isDelete;      // not (or no longer) linked into the list
+    pm::link<list_node_t> next;
+#ifdef USE_SNAPSHOTS
+    // write epoch << 2 | DEAD | LOCKED, see btree::takeSnapshot()
+    uint64_t stamp;
+    pm::link<list_node_t> older;    // the version this one replaced, while a snapshot may need it
+    constexpr static uint64_t LOCKED = 1, DEAD = 2;
+#endif
     void printAll();
 };
 
-template <typename T>
-void list_node_t<T>::printAll() {
+template <typename T, typename K>
+void list_node_t<T, K>::printAll() {
     printf("addr=%p, key=%d, ptr=%u, isUpdate=%d, isDelete=%d, next=%p\n",
-                    this, this->key, this->value, this->isUpdate, this->isDelete, this->next);
+                    this, this->key, this->value, this->isUpdate, this->isDelete, (list_node_t *)this->next);
 }
 #ifdef USE_PMDK
 POBJ_LAYOUT_BEGIN(btree);
@@ -90,7 +157,7 @@ T *alloc() {
     }
     memset(ret, 0, size);
     curr_addr += size;
-    if (curr_addr >= start_addr + SPACE_PER_THREAD) {
+    if (curr_addr >= (end_addr ? end_addr : start_addr + SPACE_PER_THREAD)) {
         printf("start_addr is %p, curr_addr is %p, SPACE_PER_THREAD is %lu, no "
                      "free space to alloc\n",
                      start_addr, curr_addr, SPACE_PER_THREAD);
@@ -100,40 +167,120 @@ T *alloc() {
 #endif
 }
 
-template <typename T>
+// Carve a block out of the calling thread's space, e.g. for a helper thread.
+inline char *reserve_space(size_t size) {
+    auto ret = curr_addr;
+    curr_addr += size;
+    if (curr_addr >= (end_addr ? end_addr : start_addr + SPACE_PER_THREAD)) {
+        printf("no free space to reserve %lu bytes\n", size);
+        exit(0);
+    }
+    return ret;
+}
+
+// Like reserve_space(), starting on a multiple of align (a power of two).
+inline char *reserve_aligned(size_t size, size_t align) {
+    curr_addr = (char *)(((uintptr_t)curr_addr + align - 1) & ~(uintptr_t)(align - 1));
+    return reserve_space(size);
+}
+
+inline void use_space(char *begin, size_t size) {
+    start_addr = curr_addr = begin;
+    end_addr = begin + size;
+}
+
+#ifdef USE_DELTA_BUFFER
+#include "delta_buffer.h"
+// PM space the merge thread allocates list nodes from
+constexpr size_t DELTA_MERGE_SPACE = 4ULL * 1024ULL * 1024ULL * 1024ULL;
+inline thread_local bool in_delta_merge = false;
+#endif
+
+#ifdef USE_LIST_COMPACTION
+// PM space the compactor copies list nodes into
+constexpr size_t COMPACTION_SPACE = 1ULL * 1024ULL * 1024ULL * 1024ULL;
+constexpr size_t XPLINE_SIZE = 256;
+#endif
+
+template <typename T, typename K = entry_key_t, typename P = wide_pages>
 class page;
 
-template <typename T>
+template <typename T, typename K = entry_key_t, typename L = entry_list, typename P = wide_pages>
 class btree{
 private:
-    int height;
-    page<T>* root;
+    std::atomic<int> height;
+    page<T, K, P>* root;
+    stat_shards shard_stats;
 
 public:
     using U = typename std::remove_pointer_t<T>;
-    list_node_t<T> *list_head = nullptr;
+    using chunk_t = typename L::template chunk<T, K>;
+    list_node_t<T, K> *list_head = nullptr;
+    chunk_t *chunk_head = nullptr;          // chunk_list: first chunk of the chain, never removed
     btree();
     ~btree();
     size_t getMemoryUsed();
     size_t getPersistentMemoryUsed();
-    std::vector<T> scan(entry_key_t, size_t);
-    std::vector<U> secondaryScan(entry_key_t, size_t);
-    void setNewRoot(page<T> *);
+    tree_stats stats();
+    std::vector<T> scan(K, size_t);
+    std::vector<U> secondaryScan(K, size_t);
+    std::vector<K> partitionKeys(K lo, K hi, size_t parts); // Cut [lo, hi) into ~equal ranges
+    template <typename F>
+    void forEach(K lo, K hi, F visit);  // visit(key, value) for keys in [lo, hi)
+    template <typename F>
+    void forEachReverse(K lo, K hi, F visit);  // The same, largest key first
+    std::vector<T> reverseScan(K, size_t);     // Up to size values from key down
+    void setNewRoot(page<T, K, P> *);
     void getNumberOfNodes();
-    void btree_insert_pred(entry_key_t, char*, char **pred, bool*);
-    void btree_insert_internal(char *, entry_key_t, char *, uint32_t);
-    void btree_delete(entry_key_t);
-    char *btree_search(entry_key_t);
-    char *btree_search_pred(entry_key_t, bool *f, char**, bool debug = false);
+    void btree_insert_pred(K, char*, char **pred, bool*);
+    void btree_insert_internal(char *, K, char *, uint32_t);
+    void btree_delete(K);
+    char *btree_search(K);
+    char *btree_search_pred(K, bool *f, char**, bool debug = false);
     void printAll();
-    T* insert(entry_key_t, T);       // Insert
-    void remove(entry_key_t);        // Remove
-    T* search(entry_key_t);          // Search
+    T* insert(K, T);       // Insert
+    void bulkAppend(const std::vector<std::pair<K, T>> &);  // Insert keys past the current maximum
+    void remove(K);        // Remove
+    T* search(K);          // Search
+#ifdef USE_ORDER_STATS
+    size_t rank(K);                   // Keys less than key
+    size_t count(K lo, K hi);         // Keys in [lo, hi)
+    T *select(size_t, K *key = nullptr); // i-th smallest key (from 0), nullptr past the end
+    double estimateCount(K lo, K hi); // count() from the inner pages only
+    void rebuildOrderStats();
+#endif
+#ifdef USE_HASH_INDEX
+    void rebuildHashIndex();
+#endif
+#ifdef USE_RELATIVE_PTR
+    void publish(attach::superblock *);  // Describe the list there for read-only processes
+#endif
+#ifdef USE_CHECKPOINT
+    btree(const char *image, char *pm_base);         // Restart from a checkpoint image
+    void checkpoint(const char *path, bool quiesced = false);
+    void checkpointEvery(const char *path, unsigned ms); // In the background, and once at shutdown
+    void reconcile();                    // Check every restored leaf against the list now
+#endif
+#ifdef USE_SNAPSHOTS
+    class snapshot;
+    snapshot takeSnapshot();             // The tree as of now, for as long as it is held
+    size_t reclaimVersions();            // Drop versions and removed keys no snapshot can read
+#endif
+#ifdef USE_LIST_COMPACTION
+    size_t compact();                    // One unthrottled pass, returns bytes moved
+    void setCompactionRate(uint64_t);    // Background pass budget in bytes/s, 0 pauses it
+#endif
+#ifdef USE_DELTA_BUFFER
+    void upsert(K, T);     // Buffered insert or update
+    void erase(K);         // Buffered remove
+    bool lookup(K, T &);   // Search buffer, then tree
+    void flushDelta();
+#endif
 
     void print()
     {
         int i = 0;
-        list_node_t<T> *tmp = list_head;
+        list_node_t<T, K> *tmp = list_head;
         while (tmp->next != nullptr) {
             //printf("%d-%d\t", tmp->next->key, tmp->next->ptr);
             tmp = tmp->next;
@@ -143,24 +290,273 @@ public:
         }
         printf("\n");
     }
-    friend class page<T>;
+    friend class page<T, K, P>;
+
+private:
+#ifdef USE_HASH_INDEX
+    // key -> list node, answers point lookups without descending the tree
+    hash_index<K, list_node_t<T, K> *> hindex;
+#endif
+#ifdef USE_DELTA_BUFFER
+    char *delta_log = nullptr;      // set before startHelpers() on a restart
+    std::unique_ptr<delta_buffer<K, T>> delta;
+    void applyDelta(K, const typename delta_buffer<K, T>::pending &);
+    void drainDelta(K key) {
+        if (!in_delta_merge)
+            delta->drain(key);
+    }
+#endif
+    list_node_t<T, K> *lower_bound(K);
+#ifdef USE_ASYNC_SPLIT
+    // separators waiting to be inserted into the parent level
+    struct pending_split {
+        K key;
+        page<T, K, P> *sibling;
+        uint32_t level;
+    };
+    constexpr static size_t SPLIT_QUEUE_CAPACITY = 1024;
+    std::mutex split_mtx;
+    std::condition_variable split_cv;
+    std::deque<pending_split> split_queue;
+    std::atomic<size_t> split_pending{0};
+    bool split_stop = false;
+    std::thread split_maintainer;
+    void splitMaintainerLoop();
+    bool helpPropagate();
+#endif
+    void propagateSplit(K, page<T, K, P> *, uint32_t);
+    page<T, K, P> *leafFor(K, page<T, K, P> **path = nullptr);
+    void rememberLeaf(page<T, K, P> *);
+    // Bracket a shadow list write between its isUpdate check and its store.
+    void listWriteBegin() {
+#if defined(USE_LIST_COMPACTION) || defined(USE_SNAPSHOTS)
+        epoch::enter();
+#endif
+    }
+    void listWriteEnd() {
+#if defined(USE_LIST_COMPACTION) || defined(USE_SNAPSHOTS)
+        epoch::leave();
+#endif
+    }
+    // cur, the last node, was unlinked with next null: a chain appendAtRightEdge
+    // linked after it meanwhile goes to prev. The appender checks isDelete
+    // after its link and this checks next after isDelete, so at least one of
+    // them sees the other; both swing the same null to the chain.
+    void passOnAppend(list_node_t<T, K> *prev, list_node_t<T, K> *cur, list_node_t<T, K> *next) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        list_node_t<T, K> *chain = cur->next;
+        if (next == nullptr && chain != nullptr)
+            pm::cas(&prev->next, nullptr, chain);
+    }
+    // Not a key removed while a snapshot was open, see versionedWrite().
+    static bool live([[maybe_unused]] list_node_t<T, K> *n) {
+#ifdef USE_SNAPSHOTS
+        return !(__atomic_load_n(&n->stamp, __ATOMIC_ACQUIRE) & list_node_t<T, K>::DEAD);
+#else
+        return true;
+#endif
+    }
+#ifdef USE_SNAPSHOTS
+    constexpr static int MAX_SNAPSHOTS = 64;
+    std::atomic<uint64_t> version_clock{1};
+    std::atomic<int> open_snapshots{0};
+    std::atomic<uint64_t> snapshot_at[MAX_SNAPSHOTS] = {};   // 0 = free slot
+    // version nodes no reader can reach any more, reused before allocating
+    static inline std::mutex spare_mtx;
+    static inline std::vector<list_node_t<T, K> *> spare_versions;
+    static void recycleVersion(void *);
+    list_node_t<T, K> *newVersion();
+    void releaseSnapshot(int slot);
+    uint64_t oldestSnapshot();
+    uint64_t lockNode(list_node_t<T, K> *);
+    void unlockNode(list_node_t<T, K> *n, uint64_t stamp) {
+        __atomic_store_n(&n->stamp, stamp, __ATOMIC_RELEASE);
+    }
+    enum { WRITTEN, UNLINKED, ABSENT };
+    int versionedWrite(list_node_t<T, K> *, const T *value);
+    void pruneVersions(list_node_t<T, K> *, uint64_t head, uint64_t oldest);
+    bool versionAt(list_node_t<T, K> *, uint64_t at, T &value);
+    bool unlinkDead(K);
+#endif
+#ifdef USE_LIST_COMPACTION
+    constexpr static int COMPACT_SCATTER_PERCENT = 25;  // leaves with more breaks get moved
+    constexpr static uint64_t DEFAULT_COMPACTION_RATE = 64ULL << 20;
+    constexpr static int COMPACT_IDLE_MS = 1000;        // pause after a pass that moved nothing
+    std::mutex compact_mtx;                             // one pass at a time
+    char *compact_curr, *compact_end;
+    std::atomic<uint64_t> compact_rate{DEFAULT_COMPACTION_RATE};
+    std::atomic<bool> compact_stop{false};
+    std::atomic<bool> compact_full{false};              // COMPACTION_SPACE used up, no more passes
+    std::thread compactor;
+    void compactorLoop();
+    size_t compactPass(uint64_t rate);
+    bool isScattered(page<T, K, P> *);
+    size_t compactLeaf(page<T, K, P> *);
+    size_t moveRun(page<T, K, P> *, page<T, K, P> *left);
+#endif
+#ifdef USE_ORDER_STATS
+    void adjustCounts(page<T, K, P> **path, K, int64_t);
+    double rankOf(K, bool exact);
+#endif
+    bool appendAtRightEdge(const std::vector<std::pair<K, T>> &);
+    constexpr static int TAIL_WAITS = 1000;  // yields for an insert at the right edge to link its node
+    void startHelpers();
+#ifdef USE_CHECKPOINT
+    char *pm_base;                       // checkpoint images store list node offsets from here
+    // An image's reference to a list node, pool id and offset with USE_RELATIVE_PTR.
+    int64_t pmRef(const void *p) const {
+#ifdef USE_RELATIVE_PTR
+        return pm::to_rel(p);
+#else
+        return (const char *)p - pm_base;
+#endif
+    }
+    char *pmAt(int64_t r) const {
+#ifdef USE_RELATIVE_PTR
+        return pm::to_abs(r);
+#else
+        return pm_base + r;
+#endif
+    }
+    checkpoint::meta *ckpt_meta;
+    std::string ckpt_path;
+    unsigned ckpt_interval_ms = 0;
+    std::mutex ckpt_mtx;                 // one checkpoint at a time
+    std::mutex ckpt_stop_mtx;
+    std::condition_variable ckpt_cv;
+    std::atomic<bool> ckpt_stop{false};
+    std::thread checkpointer, reconciler;
+    void checkpointLoop();
+    void restoreExact(const checkpoint::image<K> &);
+    void restoreLeaves(const checkpoint::image<K> &);
+    void buildInnerLevels(std::vector<page<T, K, P> *>);
+    void repairLeaf(page<T, K, P> *);
+#endif
+    // Note a write in the current checkpoint epoch, before it can reach PM.
+    void markWritten() {
+#ifdef USE_CHECKPOINT
+        auto e = ckpt_meta->epoch.load(std::memory_order_relaxed);
+        if (ckpt_meta->written.load(std::memory_order_relaxed) != e) {
+            ckpt_meta->written = e;
+            clflush((char *)&ckpt_meta->written, sizeof(uint64_t));
+        }
+#endif
+    }
+    // A leaf restored from a checkpoint is brought up to date on first touch,
+    // and so is its left neighbour: ops on its first key take their list
+    // predecessor from there.
+    void checkLeaf([[maybe_unused]] page<T, K, P> *p) {
+#ifdef USE_CHECKPOINT
+        if (p->hdr.unchecked.load(std::memory_order_acquire))
+            repairLeaf(p);
+        auto q = p->hdr.pred_ptr;
+        if (q != nullptr && q->hdr.unchecked.load(std::memory_order_acquire))
+            repairLeaf(q);
+#endif
+    }
+#ifdef USE_FINGER_HINT
+    // Last leaf each thread ended at, tagged with the tree it belongs to.
+    struct finger_hint {
+        uint64_t tree_id = 0;
+        page<T, K, P> *leaf = nullptr;
+    };
+    constexpr static int FINGER_MAX_HOPS = 2;
+    static finger_hint &finger() {
+        static thread_local finger_hint f;
+        return f;
+    }
+#endif
+    static inline std::atomic<uint64_t> next_tree_id{1};
+    const uint64_t tree_id = next_tree_id++;
+    // chunk_list: the chunk each thread puts keys without a neighbour into
+    struct open_chunk {
+        uint64_t tree_id = 0;
+        chunk_t *chunk = nullptr;
+    };
+    static open_chunk &openChunk() {
+        static thread_local open_chunk o;
+        return o;
+    }
+    chunk_t *newChunk();
+    char *claimSlot(char *near);
+    T *chunkInsert(K, T);
+    void chunkRemove(K);
+    template <typename F>
+    void leafWalk(K lo, F visit);
+    template <typename F>
+    void leafWalkReverse(K hi, bool inclusive, F visit);
+    // The value behind a leaf entry, nullptr if its list node is not linked (any more).
+    T *entryValue(char *e) {
+        if constexpr (L::chunked) {
+            return &((typename chunk_t::slot *)e)->value;
+        } else {
+            auto n = (list_node_t<T, K> *)e;
+            return n->isDelete || !live(n) ? nullptr : &n->value;
+        }
+    }
+#ifdef USE_PMDK
+    static_assert(!L::chunked, "chunk_list allocates from the thread spaces, not PMDK");
+#endif
+#if defined(USE_HASH_INDEX) || defined(USE_DELTA_BUFFER) || defined(USE_LIST_COMPACTION)
+    static_assert(!L::chunked, "the hash index, delta buffer and compactor work on list nodes, not chunks");
+#endif
+#ifdef USE_CHECKPOINT
+    static_assert(!L::chunked, "checkpoints repair leaves from the key-ordered list, chunks are not ordered");
+#endif
+#ifdef USE_SNAPSHOTS
+    static_assert(!L::chunked, "versions hang off list nodes, chunk slots have no room for them");
+#endif
 };
 
+#if defined(USE_CHECKPOINT) && (defined(USE_PMDK) || defined(USE_HASH_INDEX) || defined(USE_LIST_COMPACTION))
+#error "USE_CHECKPOINT restores the pages only: not with PMDK pools, the hash index or the compactor"
+#endif
+
 
-template <typename T>
+#ifdef USE_FLAT_COMBINING
+// A leaf insert published by a thread that found the leaf locked.
+template <typename K>
+struct fc_request {
+    enum { PENDING, DONE, DECLINED };
+
+    K key;
+    char *right;
+    char *pred = nullptr;
+    bool existed = false;
+    std::atomic<int> state{PENDING};
+    fc_request *next = nullptr;
+
+    fc_request(K key, char *right) : key(key), right(right) {}
+};
+#endif
+
+template <typename T, typename K = entry_key_t, typename P = wide_pages>
 class header{
 private:
-    page<T>* leftmost_ptr;      // 8 bytes
-    page<T>* sibling_ptr;       // 8 bytes
-    page<T>* pred_ptr;          // 8 bytes
+    page<T, K, P>* leftmost_ptr;      // 8 bytes
+    page<T, K, P>* sibling_ptr;       // 8 bytes
+    page<T, K, P>* pred_ptr;          // 8 bytes
     uint32_t level;             // 4 bytes
     uint8_t switch_counter;     // 1 bytes
     uint8_t is_deleted;         // 1 bytes
     int16_t last_index;         // 2 bytes
     std::mutex *mtx;            // 8 bytes
+#ifdef USE_FLAT_COMBINING
+    std::atomic<fc_request<K> *> fc_head; // 8 bytes, publication list
+#endif
+#ifdef UTREE_LOW_FENCE
+    K low_key;                  // separator the page was split off at, immutable;
+                                // none for the leftmost page (pred_ptr == nullptr)
+#endif
+#ifdef USE_ORDER_STATS
+    std::atomic<int64_t> subtree; // keys below an inner page, not kept for the root
+#endif
+#ifdef USE_CHECKPOINT
+    std::atomic<uint8_t> unchecked; // leaf restored from a checkpoint, not yet checked against the list
+#endif
 
-    friend class page<T>;
-    friend class btree<T>;
+    friend class page<T, K, P>;
+    template <typename, typename, typename, typename> friend class btree;
 
 public:
     header() {
@@ -172,6 +568,15 @@ public:
         switch_counter = 0;
         last_index = -1;
         is_deleted = false;
+#ifdef USE_FLAT_COMBINING
+        fc_head = nullptr;
+#endif
+#ifdef USE_ORDER_STATS
+        subtree = 0;
+#endif
+#ifdef USE_CHECKPOINT
+        unchecked = 0;
+#endif
     }
 
     ~header() {
@@ -179,10 +584,10 @@ public:
     }
 };
 
-template <typename T>
+template <typename T, typename K = entry_key_t>
 class entry{
 private:
-    entry_key_t key;
+    K key;
     char* ptr; // 8 bytes
 
 public :
@@ -191,8 +596,8 @@ public :
         ptr = nullptr;
     }
 
-    friend class page<T>;
-    friend class btree<T>;
+    template <typename, typename, typename> friend class page;
+    template <typename, typename, typename, typename> friend class btree;
 };
 
 
@@ -205,28 +610,31 @@ constexpr size_t nextPowerOf2(size_t n)
     return ret;
 }
 
-template <typename T>
+template <typename T, typename K, typename P>
 class page{
 
-    constexpr static size_t PAGESIZE = nextPowerOf2(sizeof(header<T>) + 20 * sizeof(entry<T>));
-    constexpr static size_t cardinality = (PAGESIZE-sizeof(header<T>))/sizeof(entry<T>);
-    constexpr static size_t count_in_line = CACHE_LINE_SIZE / sizeof(entry<T>);
+    // a compact entry is the key and a 4-byte handle, kept in separate arrays
+    constexpr static size_t entry_size = P::compact ? sizeof(K) + sizeof(uint32_t) : sizeof(entry<T, K>);
+    constexpr static size_t PAGESIZE = nextPowerOf2(sizeof(header<T, K, P>) + 20 * sizeof(entry<T, K>));
+    constexpr static size_t cardinality = (PAGESIZE-sizeof(header<T, K, P>))/entry_size;
+    constexpr static size_t count_in_line = CACHE_LINE_SIZE / entry_size;
 private:
-    header<T> hdr;  // header in persistent memory, 16 bytes
-    std::array<entry<T>, cardinality> records; // slots in persistent memory, 16 bytes * n
+    header<T, K, P> hdr;  // header in persistent memory, 16 bytes
+    std::conditional_t<P::compact, page_arena::records<K, cardinality>,
+                       std::array<entry<T, K>, cardinality>> records; // slots in persistent memory, 16 bytes * n
 
 public:
-    friend class btree<T>;
+    template <typename, typename, typename, typename> friend class btree;
 
     page(uint32_t level = 0) {
-        // std::cout << "Header size: " << sizeof(header<T>) << ", entrysize: " << sizeof(entry<T>)
+        // std::cout << "Header size: " << sizeof(header<T, K, P>) << ", entrysize: " << entry_size
         //  << ", entries: " << cardinality << std::endl;
         hdr.level = level;
         records[0].ptr = nullptr;
     }
 
     // this is called when tree grows
-    page(page* left, entry_key_t key, page* right, uint32_t level = 0) {
+    page(page* left, K key, page* right, uint32_t level = 0) {
         hdr.leftmost_ptr = left;
         hdr.level = level;
         records[0].key = key;
@@ -237,13 +645,48 @@ public:
     }
 
     void *operator new(size_t size) {
+        if constexpr (P::compact)
+            return page_arena::alloc(size);
         void *ret;
         posix_memalign(&ret, 64, size);
         return ret;
     }
 
     void operator delete(void* ptr) {
-        free(ptr);
+        if constexpr (!P::compact)
+            free(ptr);
+    }
+
+    // true if a writer shifted entries since switch_counter was sampled
+    inline bool version_changed(uint8_t previous_switch_counter) {
+        if(previous_switch_counter == hdr.switch_counter)
+            return false;
+        counters::add(counters::VERSION_REREAD);
+        return true;
+    }
+
+    /*
+     * Whether key belongs to sibling page s (or further right). With a low
+     * fence that is fixed at the split; s's first key can be removed and put
+     * back in this page while the separator is still on its way up, after
+     * which the parent would route it to s.
+     */
+    static inline bool in_sibling(page *s, const K &key) {
+#ifdef UTREE_LOW_FENCE
+        return !(key < s->hdr.low_key);
+#else
+        return key >= s->records[0].key;
+#endif
+    }
+
+    // The last entry left of this page, past empty pages; nullptr if none.
+    char *last_before() {
+        for(auto q = hdr.pred_ptr; q != nullptr; q = q->hdr.pred_ptr) {
+            int n = q->count();
+            if(n > 0)
+                return q->records[n - 1].ptr;
+        }
+        return nullptr;
     }
 
     inline int count() {
@@ -267,12 +710,12 @@ public:
                 }
             }
 
-        } while(previous_switch_counter != hdr.switch_counter);
+        } while(version_changed(previous_switch_counter));
 
         return count;
     }
 
-    inline bool remove_key(entry_key_t key) {
+    inline bool remove_key(K key) {
         // Set the switch_counter
         if(IS_FORWARD(hdr.switch_counter))
             ++hdr.switch_counter;
@@ -282,7 +725,7 @@ public:
         for(i = 0; records[i].ptr != nullptr; ++i) {
             if(!shift && records[i].key == key) {
                 records[i].ptr = (i == 0) ?
-                    (char *)hdr.leftmost_ptr : records[i - 1].ptr;
+                    (char *)hdr.leftmost_ptr : (char *)records[i - 1].ptr;
                 shift = true;
             }
 
@@ -298,7 +741,8 @@ public:
         return shift;
     }
 
-    bool remove(btree<T>* bt, entry_key_t key, bool only_rebalance = false, bool with_lock = true) {
+    template <typename Tree>
+    bool remove(Tree* bt, K key, bool only_rebalance = false, bool with_lock = true) {
         hdr.mtx->lock();
 
         bool ret = remove_key(key);
@@ -309,19 +753,17 @@ public:
     }
 
 
-    inline void insert_key(entry_key_t key, char* ptr, int *num_entries, bool flush = true, bool update_last_index = true) {
+    inline void insert_key(K key, char* ptr, int *num_entries, bool flush = true, bool update_last_index = true) {
         // update switch_counter
         if(!IS_FORWARD(hdr.switch_counter))
             ++hdr.switch_counter;
 
         // FAST
         if(*num_entries == 0) {  // this page is empty
-            entry<T>* new_entry = (entry<T>*) &records[0];
-            entry<T>* array_end = (entry<T>*) &records[1];
-            new_entry->key = (entry_key_t) key;
-            new_entry->ptr = (char*) ptr;
+            records[0].key = key;
+            records[0].ptr = ptr;
 
-            array_end->ptr = (char*)nullptr;
+            records[1].ptr = nullptr;
 
         }
         else {
@@ -356,8 +798,27 @@ public:
         ++(*num_entries);
     }
 
+    /*
+     * Where a full page splits: in the middle, except at the edges of a level.
+     * A key past the end of the rightmost page keeps EDGE_SPLIT_PERCENT of the
+     * entries on the left, a key before the start of the leftmost page keeps
+     * the rest on the right, so ascending or descending inserts leave mostly
+     * full pages behind instead of half empty ones.
+     */
+    constexpr static int EDGE_SPLIT_PERCENT = 90;
+
+    int split_point(K key, int num_entries) {
+        int edge = std::max(1, num_entries * (100 - EDGE_SPLIT_PERCENT) / 100);
+        if(hdr.sibling_ptr == nullptr && key > records[num_entries - 1].key)
+            return num_entries - edge;
+        if(hdr.pred_ptr == nullptr && key < records[0].key)
+            return edge;
+        return (int) ceil(num_entries/2);
+    }
+
     // Insert a new key - FAST and FAIR
-    page *store(btree<T>* bt, char* left, entry_key_t key, char* right,
+    template <typename Tree>
+    page *store(Tree* bt, char* left, K key, char* right,
          bool flush, bool with_lock, page *invalid_sibling = nullptr) {
         if(with_lock) {
             hdr.mtx->lock(); // Lock the write lock
@@ -382,11 +843,11 @@ public:
 
         // If this node has a sibling node,
         if(hdr.sibling_ptr && (hdr.sibling_ptr != invalid_sibling)) {
-            // Compare this key with the first key of the sibling
-            if(key > hdr.sibling_ptr->records[0].key) {
+            if(in_sibling(hdr.sibling_ptr, key)) {
                 if(with_lock) {
                     hdr.mtx->unlock(); // Unlock the write lock
                 }
+                counters::add(counters::SIBLING_HOP);
                 return hdr.sibling_ptr->store(bt, nullptr, key, right,
                         true, with_lock, invalid_sibling);
             }
@@ -406,9 +867,14 @@ public:
         else {// FAIR
             // overflow
             // create a new node
-            page* sibling = new page<T>(hdr.level);
-            int m = (int) ceil(num_entries/2);
-            entry_key_t split_key = records[m].key;
+            page* sibling = new page<T, K, P>(hdr.level);
+            counters::add(hdr.leftmost_ptr == nullptr ? counters::LEAF_SPLIT : counters::INNER_SPLIT);
+            bt->shard_stats.add(stat_shards::LEVEL_PAGES + hdr.level);
+            int m = split_point(key, num_entries);
+            K split_key = records[m].key;
+#ifdef UTREE_LOW_FENCE
+            sibling->hdr.low_key = split_key;   // before the sibling is linked in
+#endif
 
             // migrate half of keys into the sibling
             int sibling_cnt = 0;
@@ -451,9 +917,16 @@ public:
                 ret = sibling;
             }
 
+#ifdef USE_ORDER_STATS
+            if(hdr.leftmost_ptr != nullptr) {
+                recount();
+                sibling->recount();
+            }
+#endif
+
             // Set a new root or insert the split key to the parent
             if(bt->root == this) { // only one node can update the root ptr
-                auto new_root = new page<T>(this, split_key, sibling, hdr.level + 1);
+                auto new_root = new page<T, K, P>(this, split_key, sibling, hdr.level + 1);
                 bt->setNewRoot(new_root);
 
                 if(with_lock) {
@@ -464,8 +937,7 @@ public:
                 if(with_lock) {
                     hdr.mtx->unlock(); // Unlock the write lock
                 }
-                bt->btree_insert_internal(nullptr, split_key, (char *)sibling,
-                        hdr.level + 1);
+                bt->propagateSplit(split_key, sibling, hdr.level + 1);
             }
 
             return ret;
@@ -473,7 +945,7 @@ public:
 
     }
     // revised
-    inline void insert_key(entry_key_t key, char* ptr, int *num_entries, char **pred, bool flush = true,
+    inline void insert_key(K key, char* ptr, int *num_entries, char **pred, bool flush = true,
                            bool update_last_index = true) {
         // update switch_counter
         if(!IS_FORWARD(hdr.switch_counter))
@@ -481,15 +953,13 @@ public:
 
         // FAST
         if(*num_entries == 0) {  // this page is empty
-            entry<T>* new_entry = (entry<T>*) &records[0];
-            entry<T>* array_end = (entry<T>*) &records[1];
-            new_entry->key = (entry_key_t) key;
-            new_entry->ptr = (char*) ptr;
+            records[0].key = key;
+            records[0].ptr = ptr;
 
-            array_end->ptr = (char*)nullptr;
+            records[1].ptr = nullptr;
 
             if (hdr.pred_ptr != nullptr)
-                *pred = hdr.pred_ptr->records[hdr.pred_ptr->count() - 1].ptr;
+                *pred = last_before();
         }
         else {
             int i = *num_entries - 1, inserted = 0;
@@ -515,7 +985,7 @@ public:
                 records[0].key = key;
                 records[0].ptr = ptr;
                 if (hdr.pred_ptr != nullptr)
-                    *pred = hdr.pred_ptr->records[hdr.pred_ptr->count() - 1].ptr;
+                    *pred = last_before();
             }
         }
 
@@ -530,10 +1000,24 @@ public:
         /********
          * if key exists, return nullptr
          */
-    page *store(btree<T>* bt, char* left, entry_key_t key, char* right,
+    template <typename Tree>
+    page *store(Tree* bt, char* left, K key, char* right,
                 bool flush, bool with_lock, char **pred, page *invalid_sibling = nullptr) {
         if(with_lock) {
+#ifdef USE_FLAT_COMBINING
+            if(!hdr.mtx->try_lock()) {
+                // Contended, let the lock holder apply it along with the others.
+                fc_request<K> req(key, right);
+                if(combine_or_wait(&req)) {
+                    *pred = req.pred;
+                    return req.existed ? nullptr : this;
+                }
+                hdr.mtx->lock();
+            }
+            combine();
+#else
             hdr.mtx->lock(); // Lock the write lock
+#endif
         }
         if(hdr.is_deleted) {
             if(with_lock) {
@@ -555,11 +1039,11 @@ public:
 
         // If this node has a sibling node,
         if(hdr.sibling_ptr && (hdr.sibling_ptr != invalid_sibling)) {
-            // Compare this key with the first key of the sibling
-            if(key > hdr.sibling_ptr->records[0].key) {
+            if(in_sibling(hdr.sibling_ptr, key)) {
                 if(with_lock) {
                     hdr.mtx->unlock(); // Unlock the write lock
                 }
+                counters::add(counters::SIBLING_HOP);
                 return hdr.sibling_ptr->store(bt, nullptr, key, right,
                         true, with_lock, pred, invalid_sibling);
             }
@@ -578,9 +1062,14 @@ public:
         } else {// FAIR
             // overflow
             // create a new node
-            page* sibling = new page<T>(hdr.level);
-            int m = (int) ceil(num_entries/2);
-            entry_key_t split_key = records[m].key;
+            page* sibling = new page<T, K, P>(hdr.level);
+            counters::add(hdr.leftmost_ptr == nullptr ? counters::LEAF_SPLIT : counters::INNER_SPLIT);
+            bt->shard_stats.add(stat_shards::LEVEL_PAGES + hdr.level);
+            int m = split_point(key, num_entries);
+            K split_key = records[m].key;
+#ifdef UTREE_LOW_FENCE
+            sibling->hdr.low_key = split_key;   // before the sibling is linked in
+#endif
 
             // migrate half of keys into the sibling
             int sibling_cnt = 0;
@@ -624,9 +1113,16 @@ public:
                 ret = sibling;
             }
 
+#ifdef USE_ORDER_STATS
+            if(hdr.leftmost_ptr != nullptr) {
+                recount();
+                sibling->recount();
+            }
+#endif
+
             // Set a new root or insert the split key to the parent
             if(bt->root == this) { // only one node can update the root ptr
-                page* new_root = new page<T>(this, split_key, sibling, hdr.level + 1);
+                page* new_root = new page<T, K, P>(this, split_key, sibling, hdr.level + 1);
                 bt->setNewRoot(new_root);
 
                 if(with_lock) {
@@ -637,8 +1133,7 @@ public:
                 if(with_lock) {
                     hdr.mtx->unlock(); // Unlock the write lock
                 }
-                bt->btree_insert_internal(nullptr, split_key, (char *)sibling,
-                        hdr.level + 1);
+                bt->propagateSplit(split_key, sibling, hdr.level + 1);
             }
 
             return ret;
@@ -646,11 +1141,253 @@ public:
 
     }
 
-    char *linear_search(entry_key_t key) {
+#ifdef USE_FLAT_COMBINING
+    /*
+     * Apply every published insert in one critical section, the caller holds
+     * the lock. Requests that would split the page or belong to the sibling
+     * are declined and redone by their owners through the normal path.
+     */
+    void combine() {
+        fc_request<K> *req = hdr.fc_head.exchange(nullptr);
+        if(req == nullptr)
+            return;
+        int num_entries = count();
+        while(req != nullptr) {
+            fc_request<K> *next = req->next; // req may be gone once its state is set
+            int state = fc_request<K>::DONE;
+            int i;
+            for(i = 0; i < num_entries; i++) {
+                if(records[i].key == req->key)
+                    break;
+            }
+            if(i < num_entries) {
+                req->pred = records[i].ptr;
+                req->existed = true;
+            }
+            else if(hdr.is_deleted || num_entries >= cardinality - 1 ||
+                    (hdr.sibling_ptr && in_sibling(hdr.sibling_ptr, req->key))) {
+                state = fc_request<K>::DECLINED;
+            }
+            else {
+                insert_key(req->key, req->right, &num_entries, &req->pred);
+            }
+            counters::add(state == fc_request<K>::DONE ? counters::FC_COMBINED : counters::FC_DECLINED);
+            req->state.store(state, std::memory_order_release);
+            req = next;
+        }
+    }
+
+    // Publish req and wait until a lock holder (possibly us) has handled it.
+    bool combine_or_wait(fc_request<K> *req) {
+        req->next = hdr.fc_head.load();
+        while(!hdr.fc_head.compare_exchange_weak(req->next, req))
+            ;
+        while(true) {
+            int state = req->state.load(std::memory_order_acquire);
+            if(state != fc_request<K>::PENDING)
+                return state == fc_request<K>::DONE;
+            if(hdr.mtx->try_lock()) {
+                combine();
+                hdr.mtx->unlock();
+                continue;
+            }
+            asm volatile("pause");
+        }
+    }
+#endif
+
+#ifdef USE_ORDER_STATS
+    // Keys below this page as its parent sees them.
+    int64_t subtree_count() {
+        return hdr.leftmost_ptr == nullptr ? count() : hdr.subtree.load(std::memory_order_relaxed);
+    }
+
+    // Recompute the count of an inner page from its children.
+    void recount() {
+        auto child = hdr.leftmost_ptr;
+        int64_t n = child->subtree_count();
+        for(int i = 0; records[i].ptr != nullptr; ++i) {
+            if(records[i].ptr == (char *)child)
+                continue;           // copy left behind by an in-flight shift
+            child = (page *)records[i].ptr;
+            n += child->subtree_count();
+        }
+        hdr.subtree.store(n, std::memory_order_relaxed);
+    }
+
+    /*
+     * Child of an inner page for key, and the keys in the children left of it
+     * (unless left is nullptr). Optionally its index and the number of children.
+     */
+    page *child_for(K key, int64_t *left, int *index = nullptr, int *children = nullptr) {
+        uint8_t previous_switch_counter;
+        page *child, *ret;
+        int n, idx;
+        do {
+            previous_switch_counter = hdr.switch_counter;
+            int64_t sum = 0;
+            ret = child = hdr.leftmost_ptr;
+            n = 1;
+            idx = 0;
+            for(int i = 0; records[i].ptr != nullptr; ++i) {
+                if(records[i].ptr == (char *)child)
+                    continue;
+                if(key >= records[i].key) {
+                    if(left != nullptr)
+                        sum += child->subtree_count();
+                    ret = (page *)records[i].ptr;
+                    idx = n;
+                }
+                child = (page *)records[i].ptr;
+                ++n;
+                if(children == nullptr && ret != child)
+                    break;
+            }
+            if(left != nullptr)
+                *left = sum;
+        } while(version_changed(previous_switch_counter));
+        if(index != nullptr)
+            *index = idx;
+        if(children != nullptr)
+            *children = n;
+        return ret;
+    }
+
+    // Child of an inner page holding its i-th key; i becomes the index there.
+    page *child_at(int64_t *i) {
+        uint8_t previous_switch_counter;
+        page *child;
+        int64_t rest;
+        do {
+            previous_switch_counter = hdr.switch_counter;
+            rest = *i;
+            child = hdr.leftmost_ptr;
+            for(int j = 0; records[j].ptr != nullptr; ++j) {
+                if(records[j].ptr == (char *)child)
+                    continue;
+                int64_t n = child->subtree_count();
+                if(rest < n)
+                    break;
+                rest -= n;
+                child = (page *)records[j].ptr;
+            }
+        } while(version_changed(previous_switch_counter));
+        *i = rest;
+        return child;
+    }
+
+    // Entries of a leaf less than key.
+    int leaf_rank(K key) {
+        uint8_t previous_switch_counter;
+        int n;
+        do {
+            previous_switch_counter = hdr.switch_counter;
+            n = 0;
+            char *prev = nullptr;
+            for(int i = 0; records[i].ptr != nullptr; ++i) {
+                if(records[i].ptr == prev)
+                    continue;
+                prev = records[i].ptr;
+                if(!(records[i].key < key))
+                    break;
+                ++n;
+            }
+        } while(version_changed(previous_switch_counter));
+        return n;
+    }
+
+    // The i-th entry of a leaf, or nullptr and i less the entries it has.
+    char *leaf_at(int64_t *i, K *key) {
+        uint8_t previous_switch_counter;
+        char *ret;
+        int64_t rest;
+        do {
+            previous_switch_counter = hdr.switch_counter;
+            ret = nullptr;
+            rest = *i;
+            char *prev = nullptr;
+            for(int j = 0; records[j].ptr != nullptr; ++j) {
+                if(records[j].ptr == prev)
+                    continue;
+                prev = records[j].ptr;
+                if(rest == 0) {
+                    ret = prev;
+                    if(key != nullptr)
+                        *key = records[j].key;
+                    break;
+                }
+                --rest;
+            }
+        } while(version_changed(previous_switch_counter));
+        *i = rest;
+        return ret;
+    }
+#endif
+
+    // The entries of a leaf from key lo on (past it unless inclusive), in key order; returns how many.
+    int entries_from(K lo, bool inclusive, K *keys, char **ptrs) {
+        return entries_where([&](const K &k) { return lo < k || (inclusive && k == lo); }, keys, ptrs);
+    }
+
+    // The entries of a leaf below hi (up to it if inclusive), in key order.
+    int entries_below(K hi, bool inclusive, K *keys, char **ptrs) {
+        return entries_where([&](const K &k) { return k < hi || (inclusive && k == hi); }, keys, ptrs);
+    }
+
+    /*
+     * The entries of a leaf whose key keep() takes, in key order; returns how
+     * many. Read like linear_search(), against the direction a writer shifts
+     * entries in: a slot that repeats its left neighbour's pointer is being
+     * overwritten and an entry shifted on after it was read is seen twice.
+     * A key that changed while its pointer was read, or one out of order
+     * because several writes shifted the entries meanwhile (the switch
+     * counter only changes with the direction), makes the page read again.
+     */
+    template <typename F>
+    int entries_where(F keep, K *keys, char **ptrs) {
+        uint8_t previous_switch_counter;
+        int n;
+        bool forward, torn;
+        auto take = [&](int i) {
+            K k = records[i].key;
+            asm volatile("" ::: "memory");  // reads in this order, and again below
+            char *t = records[i].ptr;
+            asm volatile("" ::: "memory");
+            if(t == nullptr || (i > 0 && t == records[i - 1].ptr))
+                return;
+            if(k != records[i].key || (n > 0 && k != keys[n - 1] && (k < keys[n - 1]) == forward)) {
+                torn = true;
+                return;
+            }
+            if((n > 0 && k == keys[n - 1]) || !keep(k))
+                return;
+            keys[n] = k;
+            ptrs[n++] = t;
+        };
+        do {
+            previous_switch_counter = hdr.switch_counter;
+            forward = IS_FORWARD(previous_switch_counter);
+            n = 0;
+            torn = false;
+            if(forward) {
+                take(0);
+                for(int i = 1; !torn && records[i].ptr != nullptr; ++i)
+                    take(i);
+            } else {
+                for(int i = count() - 1; !torn && i >= 0; --i)
+                    take(i);
+                std::reverse(keys, keys + n);
+                std::reverse(ptrs, ptrs + n);
+            }
+        } while(torn || version_changed(previous_switch_counter));
+        return n;
+    }
+
+    char *linear_search(K key) {
         uint8_t previous_switch_counter;
         char *ret = nullptr;
         char *t;
-        entry_key_t k;
+        K k;
 
         if(hdr.leftmost_ptr == nullptr) { // Search a leaf node
             do {
@@ -702,14 +1439,16 @@ public:
                         }
                     }
                 }
-            } while(hdr.switch_counter != previous_switch_counter);
+            } while(version_changed(previous_switch_counter));
 
             if(ret) {
                 return ret;
             }
 
-            if((t = (char *)hdr.sibling_ptr) && key >= ((page *)t)->records[0].key)
+            if((t = (char *)hdr.sibling_ptr) && in_sibling((page *)t, key)) {
+                counters::add(counters::SIBLING_HOP);
                 return t;
+            }
 
             return nullptr;
         }
@@ -758,11 +1497,13 @@ public:
                         }
                     }
                 }
-            } while(hdr.switch_counter != previous_switch_counter);
+            } while(version_changed(previous_switch_counter));
 
             if((t = (char *)hdr.sibling_ptr) != nullptr) {
-                if(key >= ((page *)t)->records[0].key)
+                if(in_sibling((page *)t, key)) {
+                    counters::add(counters::SIBLING_HOP);
                     return t;
+                }
             }
 
             if(ret) {
@@ -775,7 +1516,7 @@ public:
         return nullptr;
     }
 
-    char *linear_search_pred(entry_key_t key, char **pred, bool debug=false) {
+    char *linear_search_pred(K key, char **pred, page **sibling, bool debug=false) {
         uint8_t previous_switch_counter;
         char *ret = nullptr;
         char *t;
@@ -792,10 +1533,10 @@ public:
                         printf("page:\n");
                         printAll();
                     }
-                    entry_key_t k = records[0].key;
+                    K k = records[0].key;
                     if (key < k) {
                         if (hdr.pred_ptr != nullptr){
-                            *pred = hdr.pred_ptr->records[hdr.pred_ptr->count() - 1].ptr;
+                            *pred = last_before();
                             if (debug)
                                 printf("line 752, *pred=%p\n", *pred);
                         }
@@ -809,7 +1550,7 @@ public:
 
                     if(k == key) {
                         if (hdr.pred_ptr != nullptr) {
-                            *pred = hdr.pred_ptr->records[hdr.pred_ptr->count() - 1].ptr;
+                            *pred = last_before();
                             if (debug)
                                 printf("line 772, *pred=%p\n", *pred);
                         }
@@ -822,7 +1563,7 @@ public:
                     }
 
                     for(int i=1; records[i].ptr != nullptr; ++i) {
-                        entry_key_t k = records[i].key;
+                        K k = records[i].key;
                         if (k < key){
                             *pred = records[i].ptr;
                             if (debug)
@@ -849,8 +1590,8 @@ public:
                         if (debug)
                             printf("line 793, i=%d, records[i].key=%d\n", i,
                                          records[i].key);
-                        entry_key_t k = records[i].key;
-                        entry_key_t k1 = records[i - 1].key;
+                        K k = records[i].key;
+                        K k1 = records[i - 1].key;
                         if (k1 < key && once) {
                             *pred = records[i - 1].ptr;
                             if (debug)
@@ -868,10 +1609,10 @@ public:
                     }
 
                     if(!ret) {
-                        entry_key_t k = records[0].key;
+                        K k = records[0].key;
                         if (key < k){
                             if (hdr.pred_ptr != nullptr){
-                                *pred = hdr.pred_ptr->records[hdr.pred_ptr->count() - 1].ptr;
+                                *pred = last_before();
                                 if (debug)
                                     printf("line 811, *pred=%p\n", *pred);
                             }
@@ -880,7 +1621,7 @@ public:
                             *pred = records[0].ptr;
                         if(k == key) {
                             if (hdr.pred_ptr != nullptr) {
-                                *pred = hdr.pred_ptr->records[hdr.pred_ptr->count() - 1].ptr;
+                                *pred = last_before();
                                 if (debug)
                                     printf("line 844, *pred=%p\n", *pred);
                             }
@@ -893,14 +1634,17 @@ public:
                         }
                     }
                 }
-            } while(hdr.switch_counter != previous_switch_counter);
+            } while(version_changed(previous_switch_counter));
 
             if(ret) {
                 return ret;
             }
 
-            if((t = (char *)hdr.sibling_ptr) && key >= ((page *)t)->records[0].key)
-                return t;
+            if((t = (char *)hdr.sibling_ptr) && in_sibling((page *)t, key)) {
+                counters::add(counters::SIBLING_HOP);
+                *sibling = (page *)t;
+                return nullptr;
+            }
 
             return nullptr;
         }
@@ -908,7 +1652,7 @@ public:
             do {
                 previous_switch_counter = hdr.switch_counter;
                 ret = nullptr;
-                entry_key_t k;
+                K k;
 
                 if(IS_FORWARD(previous_switch_counter)) {
                     if(key < (k = records[0].key)) {
@@ -950,11 +1694,14 @@ public:
                         }
                     }
                 }
-            } while(hdr.switch_counter != previous_switch_counter);
+            } while(version_changed(previous_switch_counter));
 
             if((t = (char *)hdr.sibling_ptr) != nullptr) {
-                if(key >= ((page *)t)->records[0].key)
-                    return t;
+                if(in_sibling((page *)t, key)) {
+                    counters::add(counters::SIBLING_HOP);
+                    *sibling = (page *)t;
+                    return nullptr;
+                }
             }
 
             if(ret) {
@@ -984,7 +1731,7 @@ public:
             printf("%x ",hdr.leftmost_ptr);
 
         for(int i=0;records[i].ptr != nullptr;++i)
-            printf("%ld,%x ", records[i].key, records[i].ptr);
+            printf("%ld,%x ", records[i].key, (char *)records[i].ptr);
 
         printf("\n%x ", hdr.sibling_ptr);
 
@@ -1036,78 +1783,225 @@ void openPmemobjPool() {
 /*
  * class btree
  */
-template<typename T>
-btree<T>::btree(){
+template <typename T, typename K, typename L, typename P>
+btree<T, K, L, P>::btree(){
 #ifdef USE_PMDK
     openPmemobjPool();
 #else
     printf("without pmdk!\n");
 #endif
-    root = new page<T>();
-    list_head = alloc<list_node_t<T>>();
+    root = new page<T, K, P>();
+    shard_stats.add(stat_shards::LEVEL_PAGES);
+    list_head = alloc<list_node_t<T, K>>();
     printf("list_head=%p\n", list_head);
     list_head->next = nullptr;
+    if constexpr (L::chunked) {
+        chunk_head = (chunk_t *)reserve_aligned(sizeof(chunk_t), L::CHUNK_BYTES);
+        chunk_head->valid = 0;
+        chunk_head->claimed = 0;
+        chunk_head->next = nullptr;
+        clflush((char *)chunk_head, sizeof(chunk_t));
+        shard_stats.add(stat_shards::PM_ALLOCATED, sizeof(chunk_t));
+    }
     height = 1;
+#ifdef USE_CHECKPOINT
+    pm_base = start_addr;
+    ckpt_meta = (checkpoint::meta *)reserve_space(sizeof(checkpoint::meta));
+    ckpt_meta->epoch = 0;
+    ckpt_meta->written = 0;
+    ckpt_meta->delta_log = 0;
+    clflush((char *)ckpt_meta, sizeof(checkpoint::meta));
+#endif
+    startHelpers();
+}
+
+// Background threads of the optional features.
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::startHelpers() {
+#ifdef USE_ASYNC_SPLIT
+    split_maintainer = std::thread(&btree<T, K, L, P>::splitMaintainerLoop, this);
+#endif
+#ifdef USE_LIST_COMPACTION
+    compact_curr = reserve_space(COMPACTION_SPACE);
+    compact_end = compact_curr + COMPACTION_SPACE;
+    compactor = std::thread(&btree<T, K, L, P>::compactorLoop, this);
+#endif
+#ifdef USE_DELTA_BUFFER
+    // A restart found the log in the checkpoint's meta; what it holds was
+    // acknowledged but maybe not merged, the constructor replays it.
+    bool restart = delta_log != nullptr;
+    if (!restart) {
+        delta_log = reserve_space(delta_buffer<K, T>::region_size());
+        memset(delta_log, 0, delta_buffer<K, T>::region_size());
+#ifdef USE_CHECKPOINT
+        ckpt_meta->delta_log = pmRef(delta_log);
+        clflush((char *)&ckpt_meta->delta_log, sizeof(int64_t));
+#endif
+    }
+    auto merge_space = reserve_space(DELTA_MERGE_SPACE);
+    delta.reset(new delta_buffer<K, T>(delta_log,
+        [this](K key, const typename delta_buffer<K, T>::pending &e) {
+            applyDelta(key, e);
+        },
+        [merge_space]() { use_space(merge_space, DELTA_MERGE_SPACE); }, restart));
+#endif
 }
 
-template<typename T>
-btree<T>::~btree() {
+template <typename T, typename K, typename L, typename P>
+btree<T, K, L, P>::~btree() {
+#ifdef USE_CHECKPOINT
+    {
+        std::lock_guard<std::mutex> lock(ckpt_stop_mtx);
+        ckpt_stop = true;
+    }
+    ckpt_cv.notify_one();
+    if (checkpointer.joinable())
+        checkpointer.join();
+    if (reconciler.joinable())
+        reconciler.join();
+#endif
+#ifdef USE_LIST_COMPACTION
+    compact_stop = true;
+    compactor.join();
+#endif
+#ifdef USE_DELTA_BUFFER
+    delta.reset();
+#endif
+#ifdef USE_ASYNC_SPLIT
+    {
+        std::lock_guard<std::mutex> lock(split_mtx);
+        split_stop = true;
+    }
+    split_cv.notify_one();
+    split_maintainer.join();
+    while (helpPropagate())
+        ;
+#endif
+#ifdef USE_CHECKPOINT
+    if (!ckpt_path.empty())
+        checkpoint(ckpt_path.c_str(), true);
+#endif
+    // The DRAM pages go away, the shadow list stays in PM.
+    auto leftmost = root;
+    while (leftmost) {
+        auto next_level = leftmost->hdr.leftmost_ptr;
+        for (auto p = leftmost; p != nullptr; ) {
+            auto sibling = p->hdr.sibling_ptr;
+            delete p;
+            p = sibling;
+        }
+        leftmost = next_level;
+    }
 #ifdef USE_PMDK
     pmemobj_close(pop);
 #endif
 }
 
-template<typename T>
-size_t btree<T>::getMemoryUsed()
+template <typename T, typename K, typename L, typename P>
+size_t btree<T, K, L, P>::getMemoryUsed()
 {
-    auto num_nodes = 0;
-    auto leftmost = root;
-    do {
-        page<T> *sibling = leftmost;
-        num_nodes += 1;
-        while(sibling) {
-            num_nodes += 1;
-            sibling = sibling->hdr.sibling_ptr;
-        }
-        leftmost = leftmost->hdr.leftmost_ptr;
-    } while(leftmost);
-    return num_nodes * sizeof(page<T>);
+    return stats().dram_bytes;
 }
 
-template<typename T>
-size_t btree<T>::getPersistentMemoryUsed()
+template <typename T, typename K, typename L, typename P>
+size_t btree<T, K, L, P>::getPersistentMemoryUsed()
 {
-    auto num_nodes = 0;
-    auto current = list_head;
-    while (current != nullptr)
-    {
-        num_nodes += 1;
-        current = current->next;
+    return stats().pm_bytes_live;
+}
+
+template <typename T, typename K, typename L, typename P>
+tree_stats btree<T, K, L, P>::stats()
+{
+    tree_stats ret{};
+    ret.height = height.load();
+    for (int i = 0; i < tree_stats::MAX_LEVELS; ++i) {
+        ret.pages[i] = shard_stats.sum(stat_shards::LEVEL_PAGES + i);
+        ret.total_pages += ret.pages[i];
     }
-    return num_nodes * sizeof(list_node_t<T>);
+    ret.dram_bytes = ret.total_pages * sizeof(page<T, K, P>);
+    ret.list_nodes = shard_stats.sum(stat_shards::LIST_NODES);
+    ret.pm_bytes_allocated = shard_stats.sum(stat_shards::PM_ALLOCATED) + sizeof(list_node_t<T, K>);
+    ret.pm_bytes_live = (ret.list_nodes + 1) * sizeof(list_node_t<T, K>);  // + list_head
+    if constexpr (L::chunked)
+        ret.pm_bytes_live = ret.pm_bytes_allocated;    // chunks are never freed
+    // every key has one leaf entry and one list node
+    ret.avg_leaf_fill = (double)ret.list_nodes / (ret.pages[0] * page<T, K, P>::cardinality);
+    return ret;
 }
 
-template<typename T>
-void btree<T>::setNewRoot(page<T> *new_root) {
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::setNewRoot(page<T, K, P> *new_root) {
     this->root = new_root;
+    shard_stats.add(stat_shards::LEVEL_PAGES + new_root->hdr.level);
     ++height;
+    counters::add(counters::ROOT_GROWTH);
 }
 
-template<typename T>
-char *btree<T>::btree_search_pred(entry_key_t key, bool *f, char **prev, bool debug){
+/*
+ * Leaf to start an op on key at. With USE_FINGER_HINT this is the leaf the
+ * thread ended at last time, or a sibling a few hops right of it, if key falls
+ * into its range; sequential and local access then skips the inner pages.
+ * Pages are never freed or merged while the tree lives and the range fences
+ * never change, so the check needs no version; a split racing with the op is
+ * handled by the usual sibling hops. Otherwise, descend from the root.
+ * Given a path, always descend and record the inner page left at each level.
+ */
+template <typename T, typename K, typename L, typename P>
+page<T, K, P> *btree<T, K, L, P>::leafFor(K key, page<T, K, P> **path) {
+#ifdef USE_FINGER_HINT
+    auto &f = finger();
+    if (path == nullptr && f.tree_id == tree_id) {
+        auto p = f.leaf;
+        if (p->hdr.pred_ptr == nullptr || key >= p->hdr.low_key) {
+            for (int hops = 0; hops <= FINGER_MAX_HOPS; ++hops) {
+                auto s = p->hdr.sibling_ptr;
+                if (s == nullptr || key < s->hdr.low_key) {
+                    counters::add(counters::FINGER_HIT);
+                    checkLeaf(p);
+                    return p;
+                }
+                p = s;
+            }
+        }
+        counters::add(counters::FINGER_MISS);
+    }
+#endif
     auto p = root;
 
     while(p->hdr.leftmost_ptr != nullptr) {
-        p = (page<T> *)p->linear_search(key);
+        if (path != nullptr)
+            path[p->hdr.level] = p;
+        p = (page<T, K, P>*)p->linear_search(key);
     }
+    checkLeaf(p);
+    return p;
+}
 
-    page<T>*t;
-    while((t = (page<T> *)p->linear_search_pred(key, prev, debug)) == p->hdr.sibling_ptr) {
-        p = t;
-        if(!p) {
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::rememberLeaf([[maybe_unused]] page<T, K, P> *p) {
+#ifdef USE_FINGER_HINT
+    auto &f = finger();
+    f.tree_id = tree_id;
+    f.leaf = p;
+#endif
+}
+
+template <typename T, typename K, typename L, typename P>
+char *btree<T, K, L, P>::btree_search_pred(K key, bool *f, char **prev, bool debug){
+    auto p = leafFor(key);
+
+    char *t;
+    while(true) {
+        // The page reports a hop itself, comparing t with a re-read of
+        // p->hdr.sibling_ptr would race with a split of p.
+        page<T, K, P> *sibling = nullptr;
+        t = p->linear_search_pred(key, prev, &sibling, debug);
+        if(!sibling)
             break;
-        }
+        p = sibling;
+        checkLeaf(p);
     }
+    rememberLeaf(p);
 
     if(!t) {
         //printf("NOT FOUND %lu, t = %p\n", key, t);
@@ -1116,18 +2010,41 @@ char *btree<T>::btree_search_pred(entry_key_t key, bool *f, char **prev, bool de
     }
 
     *f = true;
-    return (char *)t;
+    return t;
 }
 
 
-template<typename T>
-T *btree<T>::search(entry_key_t key) {
+template <typename T, typename K, typename L, typename P>
+T *btree<T, K, L, P>::search(K key) {
+#ifdef USE_DELTA_BUFFER
+    drainDelta(key);
+#endif
+#ifdef USE_HASH_INDEX
+    // The insert that links a node adds it to the hash after the link, with
+    // nothing ordering it against a remove's erase, so a hit can name a node
+    // removed or moved meanwhile; the tree has the answer then.
+    list_node_t<T, K> *node;
+    if (!hindex.find(key, node))
+        return nullptr;
+    if (!node->isDelete && !node->isUpdate && node->key == key)
+        return live(node) ? &(node->value) : nullptr;
+#endif
     bool f = false;
     char *prev;
     char *ptr = btree_search_pred(key, &f, &prev);
+#ifdef USE_HASH_INDEX
+    // Point a removed node's entry at the key's current node, if it has one.
+    if (node->isDelete) {
+        auto n = (list_node_t<T, K> *)ptr;
+        if (f && !n->isDelete)
+            hindex.insert(key, n);
+        else
+            hindex.erase(key, node);
+    }
+#endif
     if (f) {
-        list_node_t<T> *n = (list_node_t<T> *)ptr;
-        if (&(n->value) != nullptr) {
+        list_node_t<T, K> *n = (list_node_t<T, K> *)ptr;
+        if (&(n->value) != nullptr && live(n)) {
             return &(n->value);
         }
     } else {
@@ -1137,41 +2054,87 @@ T *btree<T>::search(entry_key_t key) {
 }
 
 // insert the key in the leaf node
-template<typename T>
-void btree<T>::btree_insert_pred(entry_key_t key, char* right, char **pred, bool *update){ //need to be string
-    auto p = root;
-
-    while(p->hdr.leftmost_ptr != nullptr) {
-        p = (page<T>*)p->linear_search(key);
-    }
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::btree_insert_pred(K key, char* right, char **pred, bool *update){ //need to be string
+#ifdef USE_ORDER_STATS
+    page<T, K, P> *path[tree_stats::MAX_LEVELS] = {};
+    auto p = leafFor(key, path);
+    // before the leaf changes, so the inner splits it may cause count it once
+    adjustCounts(path, key, 1);
+#else
+    auto p = leafFor(key);
+#endif
     *pred = nullptr;
-    *update = !p->store(this, nullptr, key, right, true, true, pred);
+    auto stored = p->store(this, nullptr, key, right, true, true, pred);
+    *update = !stored;
+    rememberLeaf(stored ? stored : p);
+#ifdef USE_ORDER_STATS
+    if (!stored)
+        adjustCounts(path, key, -1);
+#endif
+#ifdef USE_ASYNC_SPLIT
+    // The maintainer is falling behind, take one separator off its hands.
+    if (split_pending.load(std::memory_order_relaxed) > SPLIT_QUEUE_CAPACITY / 2)
+        helpPropagate();
+#endif
 }
 
-template<typename T>
-T* btree<T>::insert(entry_key_t key, T value) {
-    auto n = alloc<list_node_t<T>>();
+template <typename T, typename K, typename L, typename P>
+T* btree<T, K, L, P>::insert(K key, T value) {
+    if constexpr (L::chunked)
+        return chunkInsert(key, value);
+#ifdef USE_DELTA_BUFFER
+    drainDelta(key);
+#endif
+    markWritten();
+    auto n = alloc<list_node_t<T, K>>();
+    shard_stats.add(stat_shards::PM_ALLOCATED, sizeof(list_node_t<T, K>));
     //printf("n=%p\n", n);
     n->next = nullptr;
     n->key = key;
     n->value = value;
     n->isUpdate = false;
-    n->isDelete = false;
-    list_node_t<T> *prev = nullptr;
+    n->isDelete = true;     // not in the list yet
+    list_node_t<T, K> *prev = nullptr;
     bool update;
     bool rt = false;
     btree_insert_pred(key, (char *)n, (char **)&prev, &update);
     if (update && prev != nullptr) {
         // Overwrite.
+        listWriteBegin();
+        while (prev->isUpdate) {
+            // Being moved, write to the copy once the leaf points at it.
+            listWriteEnd();
+            bool f;
+            char *pred;
+            auto cur = (list_node_t<T, K> *)btree_search_pred(key, &f, &pred);
+            listWriteBegin();
+            if (!f)
+                break;
+            prev = cur;
+        }
+#ifdef USE_SNAPSHOTS
+        int written = versionedWrite(prev, &value);
+        listWriteEnd();
+        if (written == UNLINKED)
+            return insert(key, value);  // removed meanwhile, its leaf entry goes next
+        return &(prev->value);
+#else
         prev->value = value;
         //flush.
-        clflush((char *)prev, sizeof(list_node_t<T>));
+        clflush((char *)prev, sizeof(list_node_t<T, K>));
+        listWriteEnd();
+#endif
     }
     else {
         int retry_number = 0, w=0;
 retry:
     retry_number += 1;
+    if (retry_number > 1)
+        counters::add(w == 1 ? counters::INSERT_RETRY_IS_UPDATE :
+                      w == 2 ? counters::INSERT_RETRY_CAS : counters::INSERT_RETRY_VIEW);
     if (retry_number > 10 && w == 3) {
+        counters::add(counters::INSERT_GAVE_UP);
         return nullptr;
         }
         if (rt) {
@@ -1179,12 +2142,17 @@ retry:
             bool f;
             btree_search_pred(key, &f, (char **)&prev);
             if (!f) {
+                counters::add(counters::INSERT_GAVE_UP);
                 return nullptr;
                 printf("error!!!!\n");
                 exit(0);
             }
         }
         rt = true;
+        listWriteBegin();
+#ifdef USE_SNAPSHOTS
+        n->stamp = version_clock.load() << 2;
+#endif
         // Insert a new key.
         if (list_head->next != nullptr) {
 
@@ -1193,42 +2161,332 @@ retry:
                 prev = list_head;
             }
             if (prev->isUpdate){
+                listWriteEnd();
                 w = 1;
                 goto retry;
             }
 
             // check the order and CAS.
-            list_node_t<T> *next = prev->next;
+            list_node_t<T, K> *next = prev->next;
             n->next = next;
-            clflush((char *)n, sizeof(list_node_t<T>));
+            clflush((char *)n, sizeof(list_node_t<T, K>));
             if (prev->key < key && (next == nullptr || next->key > key)) {
-                if (!__sync_bool_compare_and_swap(&(prev->next), next, n)){
+                if (!pm::cas(&prev->next, next, n)){
+                    listWriteEnd();
                     w = 2;
                     goto retry;
                 }
 
-                clflush((char *)prev, sizeof(list_node_t<T>));
+                clflush((char *)prev, sizeof(list_node_t<T, K>));
             } else {
                 // View changed, retry.
+                listWriteEnd();
                 w = 3;
                 goto retry;
             }
         } else {
             // This is the first insert!
-            if (!__sync_bool_compare_and_swap(&(list_head->next), nullptr, n))
+            if (!pm::cas(&list_head->next, nullptr, n)) {
+                listWriteEnd();
+                w = 2;
                 goto retry;
+            }
         }
+        n->isDelete = false;
+        listWriteEnd();
+        counters::max(counters::INSERT_MAX_RETRIES, retry_number - 1);
+        shard_stats.add(stat_shards::LIST_NODES);
+#ifdef USE_HASH_INDEX
+        hindex.insert(key, n);
+#endif
     }
     return &(n->value);
 }
 
 
-template<typename T>
-void btree<T>::remove(entry_key_t key) {
+#ifdef USE_ORDER_STATS
+/*
+ * Add d to the subtree counts above the leaf holding key, on the pages the
+ * descent went through, moved right past splits by their fences. The root
+ * keeps no count, nobody reads it. An update racing with a split of the same
+ * inner page can end up counted on the wrong side of it; the recount at the
+ * next split of that page, or rebuildOrderStats(), corrects it.
+ */
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::adjustCounts(page<T, K, P> **path, K key, int64_t d) {
+    for (int level = 1; level < tree_stats::MAX_LEVELS && path[level] != nullptr; ++level) {
+        auto p = path[level];
+        while (p->hdr.sibling_ptr != nullptr && key >= p->hdr.sibling_ptr->hdr.low_key)
+            p = p->hdr.sibling_ptr;
+        if (p != root)
+            p->hdr.subtree.fetch_add(d, std::memory_order_relaxed);
+    }
+}
+
+/*
+ * Keys less than key, from the DRAM pages only: one descent that adds up the
+ * counts of the children left of the path and ends in a leaf. Not exact, it
+ * stops at the pages above the leaves and assumes the key sits in the middle
+ * of its child there.
+ */
+template <typename T, typename K, typename L, typename P>
+double btree<T, K, L, P>::rankOf(K key, bool exact) {
+    double left = 0;
+    auto p = root;
+    while (true) {
+        // pages split off to the right that hold only smaller keys
+        while (p->hdr.sibling_ptr != nullptr && key >= p->hdr.sibling_ptr->hdr.low_key) {
+            left += p->subtree_count();
+            p = p->hdr.sibling_ptr;
+        }
+        if (p->hdr.leftmost_ptr == nullptr)
+            return left + p->leaf_rank(key);
+        int64_t l;
+        if (!exact && p->hdr.level == 1 && p != root) {
+            int index, children;
+            p->child_for(key, nullptr, &index, &children);
+            return left + p->subtree_count() * (index + 0.5) / children;
+        }
+        p = p->child_for(key, &l);
+        left += l;
+    }
+}
+
+// Order statistics (USE_ORDER_STATS), answered without reading PM.
+template <typename T, typename K, typename L, typename P>
+size_t btree<T, K, L, P>::rank(K key) {
+    return (size_t)rankOf(key, true);
+}
+
+template <typename T, typename K, typename L, typename P>
+size_t btree<T, K, L, P>::count(K lo, K hi) {
+    if (!(lo < hi))
+        return 0;
+    int64_t n = (int64_t)rank(hi) - (int64_t)rank(lo);
+    return n > 0 ? n : 0;
+}
+
+template <typename T, typename K, typename L, typename P>
+double btree<T, K, L, P>::estimateCount(K lo, K hi) {
+    if (!(lo < hi))
+        return 0;
+    return std::max(0.0, rankOf(hi, false) - rankOf(lo, false));
+}
+
+template <typename T, typename K, typename L, typename P>
+T *btree<T, K, L, P>::select(size_t i, K *key) {
+    int64_t rest = i;
+    auto p = root;
+    while (p->hdr.leftmost_ptr != nullptr) {
+        while (p->hdr.sibling_ptr != nullptr && rest >= p->subtree_count()) {
+            rest -= p->subtree_count();
+            p = p->hdr.sibling_ptr;
+        }
+        p = p->child_at(&rest);
+    }
+    for (; p != nullptr; p = p->hdr.sibling_ptr) {
+        auto n = (list_node_t<T, K> *)p->leaf_at(&rest, key);
+        if (n != nullptr)
+            return &(n->value);
+    }
+    return nullptr;
+}
+
+// Recompute every inner page's count from the level below, without writers.
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::rebuildOrderStats() {
+    std::vector<page<T, K, P> *> leftmost;
+    for (auto p = root; p->hdr.leftmost_ptr != nullptr; p = p->hdr.leftmost_ptr)
+        leftmost.push_back(p);
+    for (auto it = leftmost.rbegin(); it != leftmost.rend(); ++it) {
+        for (auto p = *it; p != nullptr; p = p->hdr.sibling_ptr)
+            p->recount();
+    }
+}
+#endif
+
+/*
+ * Insert rows with strictly increasing keys that all lie above the largest key
+ * in the tree, e.g. a batch of time-ordered records. The rows skip the per-key
+ * path: their list nodes are chained, flushed and linked at the tail in one
+ * go, the keys top up the rightmost leaf and then go straight into fresh full
+ * leaves, whose separators are handed to the parents afterwards. Rows that do
+ * not extend the right edge are inserted one by one instead.
+ */
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::bulkAppend(const std::vector<std::pair<K, T>> &rows) {
+    if (rows.empty())
+        return;
+#ifdef USE_DELTA_BUFFER
+    for (auto &row : rows)
+        drainDelta(row.first);
+#endif
+    markWritten();
+    if (!appendAtRightEdge(rows)) {
+        for (auto &row : rows)
+            insert(row.first, row.second);
+    }
+}
+
+template <typename T, typename K, typename L, typename P>
+bool btree<T, K, L, P>::appendAtRightEdge(const std::vector<std::pair<K, T>> &rows) {
+    if constexpr (L::chunked)
+        return false;
+    for (size_t i = 1; i < rows.size(); ++i) {
+        if (!(rows[i - 1].first < rows[i].first))
+            return false;
+    }
+
+    // The rightmost leaf, locked, so nothing else can land past its end.
+#ifdef USE_ORDER_STATS
+    page<T, K, P> *path[tree_stats::MAX_LEVELS] = {};
+    auto p = leafFor(rows.front().first, path);
+#else
+    auto p = leafFor(rows.front().first);
+#endif
+    int num_entries;
+    list_node_t<T, K> *tail;
+    for (int waits = 0;; ++waits) {
+        while (true) {
+            while (p->hdr.sibling_ptr != nullptr)
+                p = p->hdr.sibling_ptr;
+            p->hdr.mtx->lock();
+            if (p->hdr.sibling_ptr == nullptr)
+                break;
+            p->hdr.mtx->unlock();
+        }
+        num_entries = p->count();
+        tail = num_entries > 0 ? (list_node_t<T, K> *)p->records[num_entries - 1].ptr : nullptr;
+        if (tail == nullptr || !(tail->key < rows.front().first) || tail->next != nullptr) {
+            p->hdr.mtx->unlock();
+            return false;
+        }
+        // A snapshot taken or a run moved meanwhile waits until the chain is linked.
+        listWriteBegin();
+        // The last entry can be an insert's node not linked yet, whose next the
+        // inserter still overwrites, or a node being moved. Let them finish.
+        if (!__atomic_load_n(&tail->isDelete, __ATOMIC_ACQUIRE) && !tail->isUpdate)
+            break;
+        listWriteEnd();
+        p->hdr.mtx->unlock();
+        if (waits == TAIL_WAITS)
+            return false;
+        std::this_thread::yield();
+    }
+#ifdef USE_SNAPSHOTS
+    uint64_t stamp = version_clock.load() << 2;
+#endif
+    std::vector<list_node_t<T, K> *> nodes(rows.size());
+    for (size_t i = 0; i < rows.size(); ++i) {
+        auto n = alloc<list_node_t<T, K>>();
+#ifdef USE_SNAPSHOTS
+        n->stamp = stamp;
+#endif
+        n->key = rows[i].first;
+        n->value = rows[i].second;
+        n->isUpdate = false;
+        n->isDelete = false;
+        n->next = nullptr;
+        if (i > 0)
+            nodes[i - 1]->next = n;
+        nodes[i] = n;
+    }
+    shard_stats.add(stat_shards::PM_ALLOCATED, rows.size() * sizeof(list_node_t<T, K>));
+    // Consecutive bump allocations are adjacent, flush them as one range.
+    if ((char *)nodes.back() == (char *)nodes.front() + (rows.size() - 1) * sizeof(list_node_t<T, K>)) {
+        clflush((char *)nodes.front(), rows.size() * sizeof(list_node_t<T, K>));
+    } else {
+        for (auto n : nodes)
+            clflush((char *)n, sizeof(list_node_t<T, K>));
+    }
+    auto front = nodes.front();
+    bool linked = pm::cas(&tail->next, nullptr, front);
+    if (linked) {
+        clflush((char *)tail, sizeof(list_node_t<T, K>));
+        // A remove of the tail racing with the link leaves the chain behind a
+        // node out of the list; see passOnAppend(), either side relinks it at
+        // the new end of the list.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for (auto last = tail; __atomic_load_n(&last->isDelete, __ATOMIC_ACQUIRE);) {
+            bool f;
+            list_node_t<T, K> *q = nullptr;
+            btree_search_pred(last->key, &f, (char **)&q);
+            if (q == nullptr)
+                q = list_head;
+            while (q->next != nullptr && q->next != front)
+                q = q->next;
+            if (q->next == nullptr && !pm::cas(&q->next, nullptr, front))
+                continue;
+            clflush((char *)q, sizeof(list_node_t<T, K>));
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            last = q;
+        }
+    }
+    listWriteEnd();
+    if (!linked) {
+        // Lost a race at the tail, the chain stays unreachable.
+        p->hdr.mtx->unlock();
+        return false;
+    }
+    shard_stats.add(stat_shards::LIST_NODES, rows.size());
+
+    // Leaf entries. The new leaves are private until p links to the first one.
+    std::vector<std::pair<K, page<T, K, P> *>> fresh;
+    auto leaf = p;
+    for (size_t i = 0; i < rows.size(); ++i) {
+        if (num_entries >= (int)page<T, K, P>::cardinality - 1) {
+            auto next = new page<T, K, P>(0);
+#ifdef UTREE_LOW_FENCE
+            next->hdr.low_key = rows[i].first;
+#endif
+            next->hdr.pred_ptr = leaf;
+            if (leaf != p)
+                leaf->hdr.sibling_ptr = next;
+            fresh.emplace_back(rows[i].first, next);
+            leaf = next;
+            num_entries = 0;
+        }
+        leaf->insert_key(rows[i].first, (char *)nodes[i], &num_entries, false);
+    }
+    shard_stats.add(stat_shards::LEVEL_PAGES, fresh.size());
+
+    size_t propagated = 0;
+    if (!fresh.empty()) {
+        p->hdr.sibling_ptr = fresh.front().second;
+        if (root == p) {
+            setNewRoot(new page<T, K, P>(p, fresh.front().first, fresh.front().second, 1));
+            propagated = 1;
+        }
+    }
+    p->hdr.mtx->unlock();
+#ifdef USE_ORDER_STATS
+    // before the separators go up, so inner splits recount the new leaves once
+    adjustCounts(path, rows.back().first, rows.size());
+#endif
+    for (size_t i = propagated; i < fresh.size(); ++i)
+        propagateSplit(fresh[i].first, fresh[i].second, 1);
+    rememberLeaf(leaf);
+#ifdef USE_HASH_INDEX
+    for (size_t i = 0; i < rows.size(); ++i)
+        hindex.insert(rows[i].first, nodes[i]);
+#endif
+    return true;
+}
+
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::remove(K key) {
+    if constexpr (L::chunked) {
+        chunkRemove(key);
+        return;
+    }
     bool f, debug=false;
-    list_node_t<T> *cur = nullptr, *prev = nullptr;
+    list_node_t<T, K> *cur = nullptr, *prev = nullptr;
+#ifdef USE_DELTA_BUFFER
+    drainDelta(key);
+#endif
+    markWritten();
 retry:
-    cur = (list_node_t<T> *)btree_search_pred(key, &f, (char **)&prev, debug);
+    cur = (list_node_t<T, K> *)btree_search_pred(key, &f, (char **)&prev, debug);
     if (!f) {
         printf("not found.\n");
         return;
@@ -1236,6 +2494,35 @@ retry:
     if (prev == nullptr) {
         prev = list_head;
     }
+    listWriteBegin();
+    if (prev->isUpdate || cur->isUpdate) {
+        // Being moved, retry once the leaf points at the copies.
+        listWriteEnd();
+        counters::add(counters::REMOVE_RETRY);
+        goto retry;
+    }
+#ifdef USE_SNAPSHOTS
+    // A snapshot may still read the key: it only dies, reclaimVersions() unlinks it.
+    if (open_snapshots.load() > 0) {
+        int written = versionedWrite(cur, nullptr);
+        listWriteEnd();
+        if (written == UNLINKED)
+            goto retry;
+        if (written == ABSENT)
+            printf("not found.\n");
+        return;
+    }
+    uint64_t stamp = lockNode(cur);
+    if (cur->isDelete || (stamp & list_node_t<T, K>::DEAD)) {
+        // Unlinked meanwhile, or already dead and waiting for reclaimVersions().
+        unlockNode(cur, stamp);
+        listWriteEnd();
+        if (cur->isDelete)
+            goto retry;
+        printf("not found.\n");
+        return;
+    }
+#endif
     if (prev->next != cur) {
         if (debug){
             printf("prev list node:\n");
@@ -1247,63 +2534,1202 @@ retry:
         goto retry;
     } else {
         // Delete it.
-        if (!__sync_bool_compare_and_swap(&(prev->next), cur, cur->next))
+        list_node_t<T, K> *next = cur->next;
+        if (!pm::cas(&prev->next, cur, next)) {
+#ifdef USE_SNAPSHOTS
+            unlockNode(cur, stamp);
+#endif
+            listWriteEnd();
+            counters::add(counters::REMOVE_RETRY);
             goto retry;
-        clflush((char *)prev, sizeof(list_node_t<T>));
+        }
+        __atomic_store_n(&cur->isDelete, true, __ATOMIC_RELEASE);
+        passOnAppend(prev, cur, next);
+#ifdef USE_SNAPSHOTS
+        pruneVersions(cur, 0, UINT64_MAX);
+        unlockNode(cur, stamp);
+#endif
+        listWriteEnd();
+        clflush((char *)prev, sizeof(list_node_t<T, K>));
+        shard_stats.add(stat_shards::LIST_NODES, -1);
+#ifdef USE_HASH_INDEX
+        hindex.erase(key, cur);
+#endif
         btree_delete(key);
     }
 
 }
 
+#ifdef USE_SNAPSHOTS
+/*
+ * Snapshots. A version clock advances by one for every snapshot taken, and
+ * each list node is stamped with the clock reading of its last write. An
+ * update while a snapshot is open copies the node's old value and stamp into
+ * a version node it points at (older), so every node leads to its past values
+ * newest first; a remove then only marks the node dead, keeping key and leaf
+ * entry. A snapshot at epoch s reads a node's newest version stamped at or
+ * before s. Writers read the clock inside an epoch guard, and taking a
+ * snapshot waits for the guards that were open, so all writes stamped at or
+ * before s are complete when the snapshot is handed out and later ones are
+ * stamped after it. Versions no open snapshot can read are cut off on the
+ * next write of their node and recycled once no reader is left in them; dead
+ * keys are unlinked by reclaimVersions().
+ *
+ * The versions live in PM like the nodes but are not needed after a restart:
+ * snapshots do not survive the process.
+ */
+template <typename T, typename K, typename L, typename P>
+class btree<T, K, L, P>::snapshot {
+    btree *tree;
+    int slot;
+    uint64_t at;
+
+    snapshot(btree *tree, int slot, uint64_t at) : tree(tree), slot(slot), at(at) {}
+    friend class btree;
+
+public:
+    snapshot(snapshot &&o) : tree(o.tree), slot(o.slot), at(o.at) { o.tree = nullptr; }
+    snapshot(const snapshot &) = delete;
+    snapshot &operator=(const snapshot &) = delete;
+    ~snapshot() {
+        if (tree != nullptr)
+            tree->releaseSnapshot(slot);
+    }
+
+    uint64_t epoch() const { return at; }
+
+    // The key's value as of the snapshot, false if it had none.
+    bool get(K key, T &value) {
+        auto n = tree->lower_bound(key);
+        return n != nullptr && n->key == key && tree->versionAt(n, at, value);
+    }
+
+    // visit(key, value) for the keys in [lo, hi) as of the snapshot, in order.
+    template <typename F>
+    void forEach(K lo, K hi, F visit) {
+        T value;
+        for (list_node_t<T, K> *n = tree->lower_bound(lo); n != nullptr && n->key < hi; n = n->next) {
+            if (tree->versionAt(n, at, value))
+                visit(n->key, (const T &)value);
+        }
+    }
+};
+
+template <typename T, typename K, typename L, typename P>
+typename btree<T, K, L, P>::snapshot btree<T, K, L, P>::takeSnapshot() {
+    open_snapshots.fetch_add(1);
+    // Registered below its epoch first, so writers keep what it may read.
+    int slot = 0;
+    for (uint64_t free = 0; !snapshot_at[slot].compare_exchange_strong(free, version_clock.load()); free = 0) {
+        if (++slot == MAX_SNAPSHOTS) {
+            printf("snapshot: more than %d open\n", MAX_SNAPSHOTS);
+            exit(1);
+        }
+    }
+    uint64_t at = version_clock.fetch_add(1);
+    snapshot_at[slot] = at;
+    epoch::synchronize();
+    return snapshot(this, slot, at);
+}
+
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::releaseSnapshot(int slot) {
+    snapshot_at[slot] = 0;
+    open_snapshots.fetch_sub(1);
+}
+
+// Epoch of the oldest open snapshot, UINT64_MAX if none is.
+template <typename T, typename K, typename L, typename P>
+uint64_t btree<T, K, L, P>::oldestSnapshot() {
+    uint64_t oldest = UINT64_MAX;
+    if (open_snapshots.load() == 0)
+        return oldest;
+    for (auto &s : snapshot_at) {
+        uint64_t e = s.load();
+        if (e != 0 && e < oldest)
+            oldest = e;
+    }
+    return oldest;
+}
+
+template <typename T, typename K, typename L, typename P>
+uint64_t btree<T, K, L, P>::lockNode(list_node_t<T, K> *n) {
+    uint64_t s = __atomic_load_n(&n->stamp, __ATOMIC_ACQUIRE);
+    while ((s & list_node_t<T, K>::LOCKED) ||
+           !__atomic_compare_exchange_n(&n->stamp, &s, s | list_node_t<T, K>::LOCKED, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        asm volatile("pause");
+        s = __atomic_load_n(&n->stamp, __ATOMIC_ACQUIRE);
+    }
+    return s;
+}
+
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::recycleVersion(void *v) {
+    std::lock_guard<std::mutex> lock(spare_mtx);
+    spare_versions.push_back((list_node_t<T, K> *)v);
+}
+
+template <typename T, typename K, typename L, typename P>
+list_node_t<T, K> *btree<T, K, L, P>::newVersion() {
+    {
+        std::lock_guard<std::mutex> lock(spare_mtx);
+        if (!spare_versions.empty()) {
+            auto v = spare_versions.back();
+            spare_versions.pop_back();
+            return v;
+        }
+    }
+    shard_stats.add(stat_shards::PM_ALLOCATED, sizeof(list_node_t<T, K>));
+    return alloc<list_node_t<T, K>>();
+}
+
+/*
+ * Overwrite cur's value, or remove the key if value is nullptr, under the
+ * node's lock and inside listWriteBegin(). The old state becomes a version if
+ * an open snapshot is older than the write. UNLINKED if cur left the list in
+ * the meantime, ABSENT if the key was dead already and this is a remove.
+ */
+template <typename T, typename K, typename L, typename P>
+int btree<T, K, L, P>::versionedWrite(list_node_t<T, K> *cur, const T *value) {
+    using node = list_node_t<T, K>;
+    // the clock before the snapshots, see takeSnapshot()
+    uint64_t w = version_clock.load();
+    uint64_t s = lockNode(cur);
+    bool dead = s & node::DEAD;
+    if (cur->isDelete || (dead && value == nullptr)) {
+        unlockNode(cur, s);
+        return cur->isDelete ? UNLINKED : ABSENT;
+    }
+    // stamps only grow along a chain, a racing writer may have read the clock later
+    w = std::max(w, s >> 2);
+    uint64_t oldest = oldestSnapshot();
+    if (oldest < w) {
+        auto v = newVersion();
+        v->key = cur->key;
+        v->value = cur->value;
+        v->isUpdate = false;
+        v->isDelete = true;    // never linked
+        v->next = nullptr;
+        v->stamp = s;
+        v->older = cur->older;
+        clflush((char *)v, sizeof(node));
+        cur->older = v;
+    }
+    pruneVersions(cur, w, oldest);
+    if (value != nullptr)
+        cur->value = *value;
+    clflush((char *)cur, sizeof(node));
+    unlockNode(cur, w << 2 | (value == nullptr ? node::DEAD : 0));
+    if (dead != (value == nullptr))
+        shard_stats.add(stat_shards::LIST_NODES, dead ? 1 : -1);
+    return WRITTEN;
+}
+
+// Cut n's versions past the newest one every open snapshot can read (n itself
+// if its head stamp is that old), with n locked.
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::pruneVersions(list_node_t<T, K> *n, uint64_t head, uint64_t oldest) {
+    list_node_t<T, K> *cut;
+    if (head <= oldest) {
+        cut = n->older;
+        n->older = nullptr;
+    } else {
+        list_node_t<T, K> *keep = n->older;
+        while (keep != nullptr && (keep->stamp >> 2) > oldest)
+            keep = keep->older;
+        if (keep == nullptr)
+            return;
+        cut = keep->older;
+        keep->older = nullptr;
+    }
+    // readers that already followed the cut finish inside their guards
+    while (cut != nullptr) {
+        list_node_t<T, K> *older = cut->older;
+        epoch::retire(cut, recycleVersion);
+        cut = older;
+    }
+}
+
+// The value n had at epoch at, false if its key was absent or dead then.
+template <typename T, typename K, typename L, typename P>
+bool btree<T, K, L, P>::versionAt(list_node_t<T, K> *n, uint64_t at, T &value) {
+    epoch::guard g;
+    uint64_t s;
+    list_node_t<T, K> *older;
+    while (true) {
+        s = __atomic_load_n(&n->stamp, __ATOMIC_ACQUIRE);
+        if (s & list_node_t<T, K>::LOCKED) {
+            asm volatile("pause");
+            continue;
+        }
+        value = n->value;
+        older = n->older;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (__atomic_load_n(&n->stamp, __ATOMIC_RELAXED) == s)
+            break;
+    }
+    if (n->isDelete)
+        return false;      // never linked, or unlinked dead before every snapshot
+    if ((s >> 2) <= at)
+        return !(s & list_node_t<T, K>::DEAD);
+    // versions are not written once linked, only cut
+    for (; older != nullptr; older = older->older) {
+        if ((older->stamp >> 2) <= at) {
+            value = older->value;
+            return !(older->stamp & list_node_t<T, K>::DEAD);
+        }
+    }
+    return false;
+}
+
+// Unlink key if it is dead and no open snapshot can still read it.
+template <typename T, typename K, typename L, typename P>
+bool btree<T, K, L, P>::unlinkDead(K key) {
+    bool f;
+    list_node_t<T, K> *cur, *prev;
+retry:
+    prev = nullptr;     // the leftmost key leaves it untouched
+    cur = (list_node_t<T, K> *)btree_search_pred(key, &f, (char **)&prev);
+    if (!f)
+        return false;
+    if (prev == nullptr)
+        prev = list_head;
+    listWriteBegin();
+    if (prev->isUpdate || cur->isUpdate) {
+        listWriteEnd();
+        goto retry;
+    }
+    uint64_t s = lockNode(cur);
+    list_node_t<T, K> *next = cur->next;
+    if (cur->isDelete || !(s & list_node_t<T, K>::DEAD) || (s >> 2) > oldestSnapshot() ||
+        prev->next != cur || !pm::cas(&prev->next, cur, next)) {
+        unlockNode(cur, s);
+        listWriteEnd();
+        return false;
+    }
+    __atomic_store_n(&cur->isDelete, true, __ATOMIC_RELEASE);
+    passOnAppend(prev, cur, next);
+    pruneVersions(cur, 0, UINT64_MAX);
+    unlockNode(cur, s);
+    listWriteEnd();
+    clflush((char *)prev, sizeof(list_node_t<T, K>));
+#ifdef USE_HASH_INDEX
+    hindex.erase(key, cur);
+#endif
+    btree_delete(key);
+    return true;
+}
+
+/*
+ * Cut every version chain down to what the open snapshots can read and unlink
+ * the keys removed before the oldest of them, all removed keys if none is
+ * open. Returns the number of keys unlinked.
+ */
+template <typename T, typename K, typename L, typename P>
+size_t btree<T, K, L, P>::reclaimVersions() {
+    std::vector<K> dead;
+    for (list_node_t<T, K> *n = list_head->next; n != nullptr; n = n->next) {
+        listWriteBegin();
+        if (!n->isUpdate && !n->isDelete) {
+            uint64_t s = lockNode(n);
+            // read under the lock, a snapshot opened later reads no older than s
+            uint64_t oldest = oldestSnapshot();
+            if ((s & list_node_t<T, K>::DEAD) && (s >> 2) <= oldest)
+                dead.push_back(n->key);
+            else
+                pruneVersions(n, s >> 2, oldest);
+            unlockNode(n, s);
+        }
+        listWriteEnd();
+    }
+    size_t unlinked = 0;
+    for (auto &key : dead)
+        unlinked += unlinkDead(key);
+    return unlinked;
+}
+#endif
+
+#ifdef USE_HASH_INDEX
+// Repopulate the hash index from the shadow list, e.g. after a restart.
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::rebuildHashIndex() {
+    hindex.clear();
+    for (list_node_t<T, K> *n = list_head->next; n != nullptr; n = n->next)
+        hindex.insert(n->key, n);
+}
+#endif
+
+#ifdef USE_RELATIVE_PTR
+// The superblock of attach.h, its magic last so a reader never takes half of it.
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::publish(attach::superblock *sb) {
+    static_assert(!L::chunked, "attach.h walks the entry_list layout");
+    auto d = attach::describe<list_node_t<T, K>>();
+    d.list_head = pm::to_rel(list_head);
+    for (int id = 1; id <= pm::last_pool; ++id)
+        d.pool_bytes[id] = pm::pools[id].size;
+    sb->magic = 0;
+    clflush((char *)&sb->magic, sizeof(uint64_t));
+    memcpy((char *)sb + sizeof(uint64_t), (char *)&d + sizeof(uint64_t), sizeof(d) - sizeof(uint64_t));
+    clflush((char *)sb, sizeof(d));
+    sb->magic = attach::MAGIC;
+    clflush((char *)&sb->magic, sizeof(uint64_t));
+}
+#endif
+
+#ifdef USE_CHECKPOINT
+/*
+ * Checkpoints: an image of the DRAM pages in a file, so a restart maps it
+ * instead of rebuilding the pages from the list. Each page is copied under its
+ * lock, with writers running the image is fuzzy across pages. It is taken as
+ * it is only if it was taken quiesced (at shutdown) and no write followed. Any
+ * other restart keeps the leaf entries, builds the inner pages over them, and
+ * brings each leaf up to date from the list when it is first touched; a
+ * background pass does the same for the leaves nobody touches.
+ */
+template <typename T, typename K, typename L, typename P>
+btree<T, K, L, P>::btree(const char *path, char *base) {
+    checkpoint::image<K> img(path);
+    if (!img.valid()) {
+        printf("checkpoint: %s is not an image of this tree\n", path);
+        exit(1);
+    }
+    auto &h = img.header();
+#ifdef USE_RELATIVE_PTR
+    constexpr uint32_t relative = checkpoint::RELATIVE;
+#else
+    constexpr uint32_t relative = 0;
+#endif
+    if ((h.flags & checkpoint::RELATIVE) != relative) {
+        printf("checkpoint: %s was written with%s USE_RELATIVE_PTR\n", path, relative ? "out" : "");
+        exit(1);
+    }
+    // Without USE_RELATIVE_PTR the list's next pointers are absolute, base
+    // must be where it was; with it the pools only need to be attached.
+    pm_base = base;
+    list_head = (list_node_t<T, K> *)pmAt(h.list_head);
+    ckpt_meta = (checkpoint::meta *)pmAt(h.meta);
+    if ((h.flags & checkpoint::EXACT) && ckpt_meta->written < h.epoch) {
+        restoreExact(img);
+    } else {
+        restoreLeaves(img);
+        reconciler = std::thread([this] {
+            auto p = root;
+            while (p->hdr.leftmost_ptr != nullptr)
+                p = p->hdr.leftmost_ptr;
+            for (; p != nullptr && !ckpt_stop; p = p->hdr.sibling_ptr)
+                checkLeaf(p);
+#ifdef USE_ORDER_STATS
+            rebuildOrderStats();
+#endif
+        });
+    }
+#ifdef USE_ORDER_STATS
+    rebuildOrderStats();
+#endif
+#ifdef USE_DELTA_BUFFER
+    if (ckpt_meta->delta_log != 0)
+        delta_log = pmAt(ckpt_meta->delta_log);
+#endif
+    startHelpers();
+}
+
+// The pages as they were, numbers turned back into pointers.
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::restoreExact(const checkpoint::image<K> &img) {
+    auto &h = img.header();
+    std::vector<page<T, K, P> *> pages(h.pages);
+    for (uint32_t i = 0; i < h.pages; ++i)
+        pages[i] = new page<T, K, P>(img.page(i).level);
+    auto at = [&](uint64_t i) {
+        if (i >= pages.size()) {
+            printf("checkpoint: page number %lu out of range\n", i);
+            exit(1);
+        }
+        return pages[i];
+    };
+    uint64_t keys = 0;
+    for (uint32_t i = 0; i < h.pages; ++i) {
+        auto &ph = img.page(i);
+        auto rec = img.records(i);
+        auto p = pages[i];
+        if (ph.count >= page<T, K, P>::cardinality) {
+            printf("checkpoint: page %u holds %u entries\n", i, ph.count);
+            exit(1);
+        }
+        if (ph.leftmost != checkpoint::NONE) {
+            p->hdr.leftmost_ptr = at(ph.leftmost);
+            p->hdr.leftmost_ptr->hdr.low_key = p->hdr.low_key;
+        }
+        if (ph.sibling != checkpoint::NONE) {
+            p->hdr.sibling_ptr = at(ph.sibling);
+            p->hdr.sibling_ptr->hdr.pred_ptr = p;
+        }
+        // parents come before their children, so low_key is already set
+        for (uint32_t j = 0; j < ph.count; ++j) {
+            p->records[j].key = rec[j].key;
+            if (ph.level > 0) {
+                auto child = at(rec[j].ref);
+                child->hdr.low_key = rec[j].key;
+                p->records[j].ptr = (char *)child;
+            } else {
+                p->records[j].ptr = pmAt(rec[j].ref);
+            }
+        }
+        p->records[ph.count].ptr = nullptr;
+        p->hdr.last_index = (int)ph.count - 1;
+        shard_stats.add(stat_shards::LEVEL_PAGES + ph.level);
+        if (ph.level == 0)
+            keys += ph.count;
+    }
+    shard_stats.add(stat_shards::LIST_NODES, keys);
+    root = pages[0];
+    height = h.height;
+}
+
+/*
+ * The leaf entries in image order, which is key order except where a leaf
+ * was copied after it split: those repeat keys of the leaf left of them and
+ * are dropped. Each leaf is marked unchecked and holds [its first key, the
+ * next leaf's first key) from then on.
+ */
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::restoreLeaves(const checkpoint::image<K> &img) {
+    auto &h = img.header();
+    std::vector<page<T, K, P> *> leaves;
+    uint64_t keys = 0;
+    bool any = false;
+    K last{};
+    for (uint32_t i = 0; i < h.pages; ++i) {
+        auto &ph = img.page(i);
+        if (ph.level != 0)
+            continue;
+        auto rec = img.records(i);
+        page<T, K, P> *p = nullptr;
+        int num_entries = 0;
+        for (uint32_t j = 0; j < ph.count && j < page<T, K, P>::cardinality - 1; ++j) {
+            if (any && !(last < rec[j].key))
+                continue;
+            if (p == nullptr)
+                p = new page<T, K, P>(0);
+            p->insert_key(rec[j].key, pmAt(rec[j].ref), &num_entries, false);
+            last = rec[j].key;
+            any = true;
+        }
+        if (p != nullptr) {
+            leaves.push_back(p);
+            keys += num_entries;
+        }
+    }
+    if (leaves.empty())
+        leaves.push_back(new page<T, K, P>(0));
+    for (size_t i = 0; i < leaves.size(); ++i) {
+        auto p = leaves[i];
+        p->hdr.unchecked = 1;
+        if (i > 0) {
+            p->hdr.low_key = p->records[0].key;
+            p->hdr.pred_ptr = leaves[i - 1];
+            leaves[i - 1]->hdr.sibling_ptr = p;
+        }
+    }
+    shard_stats.add(stat_shards::LEVEL_PAGES, leaves.size());
+    shard_stats.add(stat_shards::LIST_NODES, keys);
+    buildInnerLevels(std::move(leaves));
+}
+
+// Full inner pages over a chain of pages whose low_key is set, up to one root.
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::buildInnerLevels(std::vector<page<T, K, P> *> level) {
+    uint32_t l = 0;
+    while (level.size() > 1) {
+        ++l;
+        std::vector<page<T, K, P> *> up;
+        int num_entries = 0;
+        for (auto c : level) {
+            if (!up.empty() && num_entries < (int)page<T, K, P>::cardinality - 1) {
+                up.back()->insert_key(c->hdr.low_key, (char *)c, &num_entries, false);
+                continue;
+            }
+            auto p = new page<T, K, P>(l);
+            p->hdr.leftmost_ptr = c;
+            p->hdr.low_key = c->hdr.low_key;
+            if (!up.empty()) {
+                p->hdr.pred_ptr = up.back();
+                up.back()->hdr.sibling_ptr = p;
+            }
+            up.push_back(p);
+            num_entries = 0;
+        }
+        shard_stats.add(stat_shards::LEVEL_PAGES + l, up.size());
+        level = std::move(up);
+    }
+    root = level[0];
+    height = l + 1;
+}
+
+/*
+ * Replace the entries of an unchecked leaf with the live list nodes in its
+ * range, starting from a live node of a leaf to its left (or the list head).
+ * Nothing else writes the leaf before this, it is still locked when a writer
+ * gets to it; entries that do not fit go to fresh leaves as in bulkAppend().
+ */
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::repairLeaf(page<T, K, P> *p) {
+    p->hdr.mtx->lock();
+    if (!p->hdr.unchecked.load(std::memory_order_relaxed)) {
+        p->hdr.mtx->unlock();
+        return;
+    }
+    auto next = p->hdr.sibling_ptr;
+    auto start = list_head;
+    for (auto q = p->hdr.pred_ptr; q != nullptr && start == list_head; q = q->hdr.pred_ptr) {
+        for (int i = q->count() - 1; i >= 0; --i) {
+            auto n = (list_node_t<T, K> *)q->records[i].ptr;
+            if (n != nullptr && !n->isDelete) {
+                start = n;
+                break;
+            }
+        }
+    }
+    std::vector<std::pair<K, list_node_t<T, K> *>> run;
+    for (list_node_t<T, K> *n = start->next; n != nullptr; n = n->next) {
+        if (next != nullptr && !(n->key < next->hdr.low_key))
+            break;
+        if (p->hdr.pred_ptr != nullptr && n->key < p->hdr.low_key)
+            continue;
+        // Writers repair the leaf before they touch its keys, so a node here
+        // is linked even if the insert that linked it never got to clear
+        // (or flush) isDelete before the crash.
+        if (n->isDelete) {
+            n->isDelete = false;
+            clflush((char *)n, sizeof(list_node_t<T, K>));
+        }
+        run.emplace_back(n->key, n);
+    }
+
+    int before = p->count();
+    int num_entries = 0;
+    p->hdr.last_index = -1;
+    p->records[0].ptr = nullptr;
+    std::vector<std::pair<K, page<T, K, P> *>> fresh;
+    auto leaf = p;
+    for (auto &e : run) {
+        if (num_entries >= (int)page<T, K, P>::cardinality - 1) {
+            auto f = new page<T, K, P>(0);
+            f->hdr.low_key = e.first;
+            f->hdr.pred_ptr = leaf;
+            if (leaf != p)
+                leaf->hdr.sibling_ptr = f;
+            fresh.emplace_back(e.first, f);
+            leaf = f;
+            num_entries = 0;
+        }
+        leaf->insert_key(e.first, (char *)e.second, &num_entries, false);
+    }
+    shard_stats.add(stat_shards::LIST_NODES, (int64_t)run.size() - before);
+    shard_stats.add(stat_shards::LEVEL_PAGES, fresh.size());
+    size_t propagated = 0;
+    if (!fresh.empty()) {
+        leaf->hdr.sibling_ptr = next;
+        if (next != nullptr)
+            next->hdr.pred_ptr = leaf;
+        p->hdr.sibling_ptr = fresh.front().second;
+        if (root == p) {
+            setNewRoot(new page<T, K, P>(p, fresh.front().first, fresh.front().second, 1));
+            propagated = 1;
+        }
+    }
+    p->hdr.unchecked.store(0, std::memory_order_release);
+    p->hdr.mtx->unlock();
+    for (size_t i = propagated; i < fresh.size(); ++i)
+        propagateSplit(fresh[i].first, fresh[i].second, 1);
+}
+
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::reconcile() {
+    auto p = root;
+    while (p->hdr.leftmost_ptr != nullptr)
+        p = p->hdr.leftmost_ptr;
+    for (; p != nullptr; p = p->hdr.sibling_ptr)
+        checkLeaf(p);
+#ifdef USE_ORDER_STATS
+    rebuildOrderStats();
+#endif
+}
+
+// With quiesced, the caller guarantees no writer runs until it returns.
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::checkpoint(const char *path, bool quiesced) {
+    std::lock_guard<std::mutex> lock(ckpt_mtx);
+    if (quiesced)
+        reconcile();
+    uint64_t e = ckpt_meta->epoch + 1;
+    ckpt_meta->epoch = e;
+    clflush((char *)&ckpt_meta->epoch, sizeof(uint64_t));
+
+    std::vector<page<T, K, P> *> pages;
+    std::unordered_map<page<T, K, P> *, uint32_t> number;
+    uint32_t levels = 0;
+    for (auto first = root; first != nullptr; first = first->hdr.leftmost_ptr, ++levels) {
+        for (auto p = first; p != nullptr; p = p->hdr.sibling_ptr) {
+            number[p] = pages.size();
+            pages.push_back(p);
+        }
+    }
+    // a page split off after the numbering is left out
+    auto ref = [&](page<T, K, P> *p) {
+        auto it = number.find(p);
+        return it == number.end() ? checkpoint::NONE : it->second;
+    };
+
+    checkpoint::writer<K> w;
+    std::vector<checkpoint::record<K>> records(page<T, K, P>::cardinality);
+    for (auto p : pages) {
+        checkpoint::page_header ph;
+        p->hdr.mtx->lock();
+        ph.level = p->hdr.level;
+        ph.leftmost = p->hdr.leftmost_ptr ? ref(p->hdr.leftmost_ptr) : checkpoint::NONE;
+        ph.sibling = p->hdr.sibling_ptr ? ref(p->hdr.sibling_ptr) : checkpoint::NONE;
+        ph.count = 0;
+        for (int i = 0; p->records[i].ptr != nullptr; ++i) {
+            auto ptr = p->records[i].ptr;
+            if (ph.level > 0 && ref((page<T, K, P> *)ptr) == checkpoint::NONE)
+                continue;
+            records[ph.count].key = p->records[i].key;
+            records[ph.count++].ref = ph.level > 0 ? ref((page<T, K, P> *)ptr) : pmRef(ptr);
+        }
+        p->hdr.mtx->unlock();
+        w.page(ph, records.data());
+    }
+
+    checkpoint::image_header h{};
+    h.flags = quiesced ? (uint32_t)checkpoint::EXACT : 0;
+#ifdef USE_RELATIVE_PTR
+    h.flags |= checkpoint::RELATIVE;
+#endif
+    h.epoch = e;
+    h.pm_base = (uint64_t)pm_base;
+    h.list_head = pmRef(list_head);
+    h.meta = pmRef(ckpt_meta);
+    h.height = levels;
+    h.pages = pages.size();
+    if (!w.commit(path, h))
+        printf("checkpoint: cannot write %s\n", path);
+}
+
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::checkpointEvery(const char *path, unsigned ms) {
+    ckpt_path = path;
+    ckpt_interval_ms = ms;
+    if (ms > 0 && !checkpointer.joinable())
+        checkpointer = std::thread(&btree<T, K, L, P>::checkpointLoop, this);
+}
+
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::checkpointLoop() {
+    std::unique_lock<std::mutex> lock(ckpt_stop_mtx);
+    while (!ckpt_cv.wait_for(lock, std::chrono::milliseconds(ckpt_interval_ms),
+                             [this] { return ckpt_stop.load(); })) {
+        lock.unlock();
+        checkpoint(ckpt_path.c_str());
+        lock.lock();
+    }
+}
+#endif
+
+/*
+ * chunk_list: a new key goes into a slot next to its predecessor's, in the
+ * same chunk if that has room, else into the chunk this thread is filling. The
+ * slot is written and flushed, the leaf takes it, and only then does its
+ * valid bit go on; like the entry layout, the PM write that makes the key
+ * durable happens after the leaf lock is released.
+ */
+template <typename T, typename K, typename L, typename P>
+T *btree<T, K, L, P>::chunkInsert(K key, T value) {
+    using slot = typename chunk_t::slot;
+    bool f = false;
+    char *near = nullptr;
+    auto hit = (slot *)btree_search_pred(key, &f, &near);
+    if (f && hit->key == key) {     // else a read torn by a shift, the leaf lock sorts it out
+        hit->value = value;
+        clflush((char *)hit, sizeof(slot));
+        return &(hit->value);
+    }
+    auto s = (slot *)claimSlot(near);
+    s->key = key;
+    s->value = value;
+    clflush((char *)s, sizeof(slot));
+
+    char *existing = nullptr;
+    bool update;
+    btree_insert_pred(key, (char *)s, &existing, &update);
+    auto c = chunk_t::of(s);
+    if (update && existing != nullptr) {
+        // Inserted by someone else meanwhile, overwrite theirs.
+        c->release(s);
+        auto e = (slot *)existing;
+        e->value = value;
+        clflush((char *)e, sizeof(slot));
+        return &(e->value);
+    }
+    c->valid.fetch_or(c->bit(s));
+    clflush((char *)&c->valid, sizeof(uint64_t));
+    shard_stats.add(stat_shards::LIST_NODES);
+    return &(s->value);
+}
+
+template <typename T, typename K, typename L, typename P>
+char *btree<T, K, L, P>::claimSlot(char *near) {
+    if (near != nullptr) {
+        if (auto s = chunk_t::of(near)->claim())
+            return (char *)s;
+    }
+    auto &o = openChunk();
+    while (true) {
+        if (o.tree_id == tree_id && o.chunk != nullptr) {
+            if (auto s = o.chunk->claim())
+                return (char *)s;
+        }
+        o.tree_id = tree_id;
+        o.chunk = newChunk();
+    }
+}
+
+// A chunk from the calling thread's space, linked in right after the head.
+template <typename T, typename K, typename L, typename P>
+typename btree<T, K, L, P>::chunk_t *btree<T, K, L, P>::newChunk() {
+    auto c = (chunk_t *)reserve_aligned(sizeof(chunk_t), L::CHUNK_BYTES);
+    c->valid = 0;
+    c->claimed = 0;
+    do {
+        c->next = chunk_head->next;
+        clflush((char *)c, sizeof(chunk_t));
+    } while (!pm::cas(&chunk_head->next, c->next, c));
+    clflush((char *)&(chunk_head->next), sizeof(chunk_t *));
+    shard_stats.add(stat_shards::PM_ALLOCATED, sizeof(chunk_t));
+    return c;
+}
+
+/*
+ * The valid bit goes first, that is the durable remove; then the leaf entry.
+ * A slot in the leaf whose bit is off belongs to an insert that has not set
+ * the bit yet or to a remove that has not taken the entry out yet (one of
+ * another key is a read torn by a shift). Clearing
+ * nothing and going on would let that insert set the bit of a slot no leaf
+ * points to, which comes back on restart, so the remove waits for either one
+ * and looks again; only the remove that clears the bit deletes the entry.
+ */
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::chunkRemove(K key) {
+    while (true) {
+        bool f = false;
+        char *prev;
+        auto s = (typename chunk_t::slot *)btree_search_pred(key, &f, &prev);
+        if (!f) {
+            printf("not found.\n");
+            return;
+        }
+        auto c = chunk_t::of(s);
+        if (s->key == key && (c->valid.fetch_and(~c->bit(s)) & c->bit(s))) {
+            clflush((char *)&c->valid, sizeof(uint64_t));
+            shard_stats.add(stat_shards::LIST_NODES, -1);
+            break;
+        }
+        std::this_thread::yield();
+    }
+    btree_delete(key);
+}
+
+/*
+ * visit(key, entry) for the leaf entries from key lo on, in key order, along
+ * the leaves, until it returns false. Each leaf is read from past the last key
+ * visited, so keys a split moved to the next leaf after this one was read are
+ * skipped there.
+ */
+template <typename T, typename K, typename L, typename P>
+template <typename F>
+void btree<T, K, L, P>::leafWalk(K lo, F visit) {
+    K keys[page<T, K, P>::cardinality];
+    char *ptrs[page<T, K, P>::cardinality];
+    bool inclusive = true;
+    for (auto p = leafFor(lo); p != nullptr; p = p->hdr.sibling_ptr) {
+        int n = p->entries_from(lo, inclusive, keys, ptrs);
+        for (int i = 0; i < n; ++i) {
+            if (!visit(keys[i], ptrs[i]))
+                return;
+        }
+        if (n > 0) {
+            lo = keys[n - 1];
+            inclusive = false;
+        }
+    }
+}
+
+/*
+ * visit(key, entry) for the leaf entries below hi (up to it if inclusive), in
+ * descending key order, leaf by leaf along pred_ptr, until it returns false.
+ * The list nodes of a leaf are prefetched before the first is visited. A leaf
+ * split after the walk took the pointer to it has put its upper keys into a
+ * new page between it and the leaf the walk came from; its sibling_ptr leads
+ * there, and those keys are visited first.
+ */
+template <typename T, typename K, typename L, typename P>
+template <typename F>
+void btree<T, K, L, P>::leafWalkReverse(K hi, bool inclusive, F visit) {
+    K keys[page<T, K, P>::cardinality];
+    char *ptrs[page<T, K, P>::cardinality];
+    page<T, K, P> *from = nullptr;
+    auto p = leafFor(hi);
+    while (p != nullptr) {
+        checkLeaf(p);
+        int n = p->entries_below(hi, inclusive, keys, ptrs);
+        auto s = p->hdr.sibling_ptr;
+#ifdef UTREE_LOW_FENCE
+        if (s != nullptr && s != from && (s->hdr.low_key < hi || (inclusive && s->hdr.low_key == hi))) {
+#else
+        if (s != nullptr && s != from && (s->records[0].key < hi || (inclusive && s->records[0].key == hi))) {
+#endif
+            p = s;
+            continue;
+        }
+        for (int i = 0; i < n; ++i)
+            __builtin_prefetch(ptrs[i]);
+        for (int i = n - 1; i >= 0; --i) {
+            if (!visit(keys[i], ptrs[i]))
+                return;
+        }
+        if (n > 0) {
+            hi = keys[0];
+            inclusive = false;
+        }
+        from = p;
+        p = p->hdr.pred_ptr;
+    }
+}
+
+#ifdef USE_LIST_COMPACTION
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::setCompactionRate(uint64_t bytes_per_s) {
+    compact_rate = bytes_per_s;
+}
+
+template <typename T, typename K, typename L, typename P>
+size_t btree<T, K, L, P>::compact() {
+    return compactPass(0);
+}
+
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::compactorLoop() {
+    while (!compact_stop && !compact_full) {
+        uint64_t rate = compact_rate;
+        size_t moved = rate > 0 ? compactPass(rate) : 0;
+        for (int ms = 0; moved == 0 && ms < COMPACT_IDLE_MS && !compact_stop; ms += 10)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+/*
+ * Walk the leaves left to right and move the list nodes of every scattered
+ * one. With a rate, sleep after each leaf long enough to stay under it; the
+ * leaf locks are only tried, a leaf a writer holds is left for the next pass.
+ */
+template <typename T, typename K, typename L, typename P>
+size_t btree<T, K, L, P>::compactPass(uint64_t rate) {
+    std::lock_guard<std::mutex> lock(compact_mtx);
+    // Runs of neighbouring leaves end up back to back, start on an XPLine.
+    compact_curr = (char *)(((uintptr_t)compact_curr + XPLINE_SIZE - 1) & ~(uintptr_t)(XPLINE_SIZE - 1));
+    auto p = root;
+    while (p->hdr.leftmost_ptr != nullptr)
+        p = p->hdr.leftmost_ptr;
+    size_t total = 0;
+    for (; p != nullptr && !compact_stop && !compact_full; p = p->hdr.sibling_ptr) {
+        if (!isScattered(p))
+            continue;
+        size_t moved = compactLeaf(p);
+        total += moved;
+        if (rate > 0 && moved > 0)
+            std::this_thread::sleep_for(std::chrono::microseconds(moved * 1000000 / rate));
+    }
+    return total;
+}
+
+// More than COMPACT_SCATTER_PERCENT of neighbouring keys not adjacent in PM.
+template <typename T, typename K, typename L, typename P>
+bool btree<T, K, L, P>::isScattered(page<T, K, P> *p) {
+    int num_entries = p->count();
+    int breaks = 0;
+    for (int i = 1; i < num_entries; ++i) {
+        if (p->records[i].ptr != p->records[i - 1].ptr + sizeof(list_node_t<T, K>))
+            ++breaks;
+    }
+    return num_entries > 1 && breaks * 100 > num_entries * COMPACT_SCATTER_PERCENT;
+}
+
+// Lock p and its left neighbour, so neither splits or takes keys, then move.
+template <typename T, typename K, typename L, typename P>
+size_t btree<T, K, L, P>::compactLeaf(page<T, K, P> *p) {
+    auto left = p->hdr.pred_ptr;
+    if (left != nullptr && !left->hdr.mtx->try_lock())
+        return 0;
+    size_t moved = 0;
+    if (p->hdr.mtx->try_lock()) {
+        if (left == nullptr || left->hdr.sibling_ptr == p)
+            moved = moveRun(p, left);
+        p->hdr.mtx->unlock();
+    }
+    if (left != nullptr)
+        left->hdr.mtx->unlock();
+    return moved;
+}
+
+/*
+ * Copy the list nodes of leaf p into one contiguous chunk in key order. The
+ * predecessor (left's last linked node, or the list head) and p's nodes are
+ * marked isUpdate, which sends list writers to retry, and the writers already
+ * past that check are waited out; what is linked then stays put. The chunk is
+ * flushed before the predecessor's next swings to it, so after a crash the
+ * list holds either the old run or the new one. Then the leaf slots and the
+ * hash index move over. The old nodes stay marked and unreachable from the
+ * list; readers that already hold one see its value as of the move, so their
+ * space is not reused, and once a leaf's nodes no longer fit the compactor
+ * stops for good.
+ */
+template <typename T, typename K, typename L, typename P>
+size_t btree<T, K, L, P>::moveRun(page<T, K, P> *p, page<T, K, P> *left) {
+    using node = list_node_t<T, K>;
+    int num_entries = p->count();
+    node *pred = left == nullptr ? list_head : nullptr;
+    for (int i = left == nullptr ? -1 : left->count() - 1; i >= 0 && pred == nullptr; --i) {
+        if (!((node *)left->records[i].ptr)->isDelete)
+            pred = (node *)left->records[i].ptr;
+    }
+    if (pred == nullptr || num_entries < 2)
+        return 0;
+    if (compact_curr + num_entries * sizeof(node) > compact_end) {
+        compact_full = true;
+        return 0;
+    }
+    K last = p->records[num_entries - 1].key;
+
+    pred->isUpdate = true;
+    for (int i = 0; i < num_entries; ++i)
+        ((node *)p->records[i].ptr)->isUpdate = true;
+    epoch::synchronize();
+
+    // Nodes of p whose insert has not linked them yet are left where they are.
+    std::vector<node *> run;
+    bool ok = !pred->isDelete;
+    for (node *n = pred->next; ok && n != nullptr && !(last < n->key); n = n->next) {
+        ok = n->isUpdate;
+        run.push_back(n);
+    }
+    size_t bytes = run.size() * sizeof(node);
+    if (!ok || run.size() < 2 || compact_curr + bytes > compact_end) {
+        for (int i = 0; i < num_entries; ++i)
+            ((node *)p->records[i].ptr)->isUpdate = false;
+        pred->isUpdate = false;
+        counters::add(counters::COMPACT_ABORTED);
+        return 0;
+    }
+
+    auto chunk = (node *)compact_curr;
+    compact_curr += bytes;
+    for (size_t i = 0; i < run.size(); ++i) {
+        chunk[i].key = run[i]->key;
+        chunk[i].value = run[i]->value;
+        chunk[i].isUpdate = false;
+        chunk[i].isDelete = false;
+#ifdef USE_SNAPSHOTS
+        chunk[i].stamp = run[i]->stamp;
+        chunk[i].older = run[i]->older;
+#endif
+        chunk[i].next = i + 1 < run.size() ? &chunk[i + 1] : (node *)run.back()->next;
+    }
+    clflush((char *)chunk, bytes);
+    pm::cas(&pred->next, run.front(), chunk);
+    clflush((char *)pred, sizeof(node));
+    shard_stats.add(stat_shards::PM_ALLOCATED, bytes);
+
+    // Both in key order.
+    for (int i = 0, j = 0; i < num_entries && j < (int)run.size(); ++i) {
+        if ((node *)p->records[i].ptr != run[j])
+            continue;
+        p->records[i].ptr = (char *)&chunk[j];
+#ifdef USE_HASH_INDEX
+        hindex.insert(chunk[j].key, &chunk[j]);
+#endif
+        ++j;
+    }
+    for (int i = 0; i < num_entries; ++i) {
+        auto n = (node *)p->records[i].ptr;
+        if (n < chunk || n >= chunk + run.size())
+            n->isUpdate = false;   // not linked, nothing was copied
+    }
+    pred->isUpdate = false;
+    counters::add(counters::COMPACT_LEAVES);
+    counters::add(counters::COMPACT_BYTES, bytes);
+    return bytes;
+}
+#endif
+
+#ifdef USE_DELTA_BUFFER
+// Called by the merge thread (or a drain) with one buffered entry, in key order.
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::applyDelta(K key, const typename delta_buffer<K, T>::pending &e) {
+    in_delta_merge = true;
+    counters::add(counters::DELTA_MERGED);
+    if (!e.deleted) {
+        insert(key, e.value);
+    } else {
+        bool f;
+        char *prev;
+        btree_search_pred(key, &f, &prev);
+        if (f)
+            remove(key);
+    }
+    in_delta_merge = false;
+}
+
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::upsert(K key, T value) {
+    delta->put(key, value);
+}
+
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::erase(K key) {
+    delta->put(key, T(), true);
+}
+
+template <typename T, typename K, typename L, typename P>
+bool btree<T, K, L, P>::lookup(K key, T &value) {
+    typename delta_buffer<K, T>::pending e;
+    if (delta->get(key, e)) {
+        if (e.deleted)
+            return false;
+        value = e.value;
+        return true;
+    }
+    auto ptr = search(key);
+    if (ptr == nullptr)
+        return false;
+    value = *ptr;
+    return true;
+}
+
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::flushDelta() {
+    delta->flush();
+}
+#endif
+
+/*
+ * Insert the separator of a split page into its parent. With USE_ASYNC_SPLIT
+ * this is left to the maintainer thread, the new page is reachable through
+ * sibling_ptr until then. A full queue falls back to doing it in place.
+ */
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::propagateSplit(K key, page<T, K, P> *sibling, uint32_t level) {
+#ifdef USE_ASYNC_SPLIT
+    {
+        std::lock_guard<std::mutex> lock(split_mtx);
+        if (split_queue.size() < SPLIT_QUEUE_CAPACITY) {
+            split_queue.push_back({key, sibling, level});
+            ++split_pending;
+            split_cv.notify_one();
+            counters::add(counters::SPLIT_DEFERRED);
+            return;
+        }
+    }
+    counters::add(counters::SPLIT_INLINE_FALLBACK);
+#endif
+    btree_insert_internal(nullptr, key, (char *)sibling, level);
+}
+
+#ifdef USE_ASYNC_SPLIT
+template <typename T, typename K, typename L, typename P>
+bool btree<T, K, L, P>::helpPropagate() {
+    pending_split s;
+    {
+        std::lock_guard<std::mutex> lock(split_mtx);
+        if (split_queue.empty())
+            return false;
+        s = split_queue.front();
+        split_queue.pop_front();
+    }
+    btree_insert_internal(nullptr, s.key, (char *)s.sibling, s.level);
+    --split_pending;
+    return true;
+}
+
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::splitMaintainerLoop() {
+    std::unique_lock<std::mutex> lock(split_mtx);
+    while (true) {
+        split_cv.wait(lock, [this] { return split_stop || !split_queue.empty(); });
+        if (split_stop)
+            return;
+        lock.unlock();
+        helpPropagate();
+        lock.lock();
+    }
+}
+#endif
+
 // store the key into the node at the given level
-template<typename T>
-void btree<T>::btree_insert_internal(char *left, entry_key_t key, char *right, uint32_t level) {
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::btree_insert_internal(char *left, K key, char *right, uint32_t level) {
     if(level > root->hdr.level)
         return;
 
     auto p = root;
 
     while(p->hdr.level > level)
-        p = (page<T> *)p->linear_search(key);
+        p = (page<T, K, P> *)p->linear_search(key);
 
     if(!p->store(this, nullptr, key, right, true, true)) {
         btree_insert_internal(left, key, right, level);
     }
 }
 
-template<typename T>
-void btree<T>::btree_delete(entry_key_t key) {
-    auto p = root;
-
-    while(p->hdr.leftmost_ptr != nullptr){
-        p = (page<T>*) p->linear_search(key);
-    }
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::btree_delete(K key) {
+#ifdef USE_ORDER_STATS
+    page<T, K, P> *path[tree_stats::MAX_LEVELS] = {};
+    auto p = leafFor(key, path);
+#else
+    auto p = leafFor(key);
+#endif
 
-    page<T> *t;
-    while((t = (page<T> *)p->linear_search(key)) == p->hdr.sibling_ptr) {
+    // Without the lock linear_search() can miss a key a writer is shifting, so
+    // only its sibling hops are followed and the page lock decides the rest.
+    page<T, K, P> *t;
+    while((t = (page<T, K, P> *)p->linear_search(key)) != nullptr && t == p->hdr.sibling_ptr) {
         p = t;
-        if(!p)
-            break;
+        checkLeaf(p);
     }
 
-    if(p) {
-        if(!p->remove(this, key)) {
-            btree_delete(key);
-        }
+    if(p->remove(this, key)) {
+#ifdef USE_ORDER_STATS
+        adjustCounts(path, key, -1);
+#endif
+    }
+    else if(p->hdr.sibling_ptr && page<T, K, P>::in_sibling(p->hdr.sibling_ptr, key)) {
+        btree_delete(key);  // moved on by a split meanwhile
     }
     else {
         printf("not found the key to delete %lu\n", key);
     }
 }
 
-template<typename T>
-void btree<T>::printAll(){
+template <typename T, typename K, typename L, typename P>
+void btree<T, K, L, P>::printAll(){
     pthread_mutex_lock(&print_mtx);
     int total_keys = 0;
     auto leftmost = root;
     printf("root: %x\n", root);
     do {
-        page<T> *sibling = leftmost;
+        page<T, K, P> *sibling = leftmost;
         while(sibling) {
             if(sibling->hdr.level == 0) {
                 total_keys += sibling->hdr.last_index + 1;
@@ -1319,37 +3745,195 @@ void btree<T>::printAll(){
     pthread_mutex_unlock(&print_mtx);
 }
 
-template <typename T>
-std::vector<T> btree<T>::scan(entry_key_t key, size_t size)
+// First list node with a key not less than key.
+template <typename T, typename K, typename L, typename P>
+list_node_t<T, K> *btree<T, K, L, P>::lower_bound(K key)
+{
+    bool f = false;
+    char *prev = nullptr;
+    auto ptr = (list_node_t<T, K> *) btree_search_pred(key, &f, &prev);
+    if (f)
+        return ptr;
+    list_node_t<T, K> *n = prev ? ((list_node_t<T, K> *) prev)->next : list_head->next;
+    while (n != nullptr && n->key < key)
+        n = n->next;
+    return n;
+}
+
+template <typename T, typename K, typename L, typename P>
+std::vector<T> btree<T, K, L, P>::scan(K key, size_t size)
 {
     std::vector<T> result;
+    if constexpr (L::chunked) {
+        leafWalk(key, [&](const K &k, char *e) {
+            if (result.empty() && k != key)
+                return false;
+            result.push_back(((typename chunk_t::slot *)e)->value);
+            return result.size() < size;
+        });
+        return result;
+    }
+#ifdef USE_DELTA_BUFFER
+    // Merge buffered entries over the list, the buffer is always newer.
+    auto buffered = delta->range(key, size);
+    if (buffered.empty())
+        goto tree_only;
+    {
+        auto node = lower_bound(key);
+        bool present = buffered[0].first == key ? !buffered[0].second.deleted
+                                                : node != nullptr && node->key == key;
+        if (!present)
+            return {};
+        auto it = buffered.begin();
+        while (result.size() < size && (node != nullptr || it != buffered.end())) {
+            if (it == buffered.end() || (node != nullptr && node->key < it->first)) {
+                result.push_back(node->value);
+                node = node->next;
+                continue;
+            }
+            if (node != nullptr && node->key == it->first)
+                node = node->next;
+            if (!it->second.deleted)
+                result.push_back(it->second.value);
+            ++it;
+        }
+        return result;
+    }
+tree_only:
+#endif
     bool f = false;
     char *prev;
-    auto ptr = (list_node_t<T> *) btree_search_pred(key, &f, &prev);
-    if (!f) {
+    auto ptr = (list_node_t<T, K> *) btree_search_pred(key, &f, &prev);
+    if (!f || !live(ptr)) {
         return {};
     }
     while (ptr != nullptr && result.size() < size)
     {
-        result.push_back(ptr->value);
+        if (live(ptr))
+            result.push_back(ptr->value);
         ptr = ptr->next;
     }
     return result;
 }
 
-template <typename T>
-std::vector<typename btree<T>::U> btree<T>::secondaryScan(entry_key_t key, size_t size)
+/*
+ * Up to parts - 1 sorted keys in (lo, hi) that cut the range into pieces of
+ * roughly equal size, read from the DRAM pages only: the separators of the
+ * highest inner level that has a few per piece in the range, evenly sampled.
+ * Separators of one level split the keys below them about evenly, so the
+ * pieces stay balanced without touching the list. Fewer keys come back when
+ * the range spans fewer leaves than parts.
+ */
+template <typename T, typename K, typename L, typename P>
+std::vector<K> btree<T, K, L, P>::partitionKeys(K lo, K hi, size_t parts)
+{
+    std::vector<K> keys;
+    if (parts < 2 || !(lo < hi))
+        return keys;
+    for (int level = root->hdr.level; level >= 1; --level) {
+        keys.clear();
+        auto p = root;
+        while ((int)p->hdr.level > level)
+            p = (page<T, K, P> *)p->linear_search(lo);
+        for (bool past = false; p != nullptr && !past; p = p->hdr.sibling_ptr) {
+            for (int i = 0; p->records[i].ptr != nullptr; ++i) {
+                K k = p->records[i].key;
+                if (!(k < hi)) {
+                    past = true;
+                    break;
+                }
+                if (lo < k)
+                    keys.push_back(k);
+            }
+        }
+        if (keys.size() >= 4 * parts)
+            break;
+    }
+    // concurrent splits can shift entries under the reader
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    if (keys.size() > parts - 1) {
+        std::vector<K> picked;
+        for (size_t i = 1; i < parts; ++i)
+            picked.push_back(keys[i * keys.size() / parts]);
+        picked.erase(std::unique(picked.begin(), picked.end()), picked.end());
+        keys.swap(picked);
+    }
+    return keys;
+}
+
+// Walks the list; entries still in the delta buffer are not visited.
+template <typename T, typename K, typename L, typename P>
+template <typename F>
+void btree<T, K, L, P>::forEach(K lo, K hi, F visit)
+{
+    if constexpr (L::chunked) {
+        leafWalk(lo, [&](const K &k, char *e) {
+            if (!(k < hi))
+                return false;
+            visit(k, ((typename chunk_t::slot *)e)->value);
+            return true;
+        });
+        return;
+    }
+    for (auto n = lower_bound(lo); n != nullptr && n->key < hi; n = n->next) {
+        if (live(n))
+            visit(n->key, n->value);
+    }
+}
+
+// Reads the leaves, not the list; entries still in the delta buffer are not visited.
+template <typename T, typename K, typename L, typename P>
+template <typename F>
+void btree<T, K, L, P>::forEachReverse(K lo, K hi, F visit)
+{
+    leafWalkReverse(hi, false, [&](const K &k, char *e) {
+        if (k < lo)
+            return false;
+        if (auto v = entryValue(e))
+            visit(k, (const T &)*v);
+        return true;
+    });
+}
+
+// Unlike scan(), key need not be in the tree: the largest key up to it comes first.
+template <typename T, typename K, typename L, typename P>
+std::vector<T> btree<T, K, L, P>::reverseScan(K key, size_t size)
+{
+    std::vector<T> result;
+    if (size == 0)
+        return result;
+    leafWalkReverse(key, true, [&](const K &, char *e) {
+        if (auto v = entryValue(e))
+            result.push_back(*v);
+        return result.size() < size;
+    });
+    return result;
+}
+
+template <typename T, typename K, typename L, typename P>
+std::vector<typename btree<T, K, L, P>::U> btree<T, K, L, P>::secondaryScan(K key, size_t size)
 {
     std::vector<U> result;
+    if constexpr (L::chunked) {
+        leafWalk(key, [&](const K &k, char *e) {
+            if (result.empty() && k != key)
+                return false;
+            result.push_back(*((typename chunk_t::slot *)e)->value);
+            return result.size() < size;
+        });
+        return result;
+    }
     bool f = false;
     char *prev;
-    auto ptr = (list_node_t<T> *) btree_search_pred(key, &f, &prev);
-    if (!f) {
+    auto ptr = (list_node_t<T, K> *) btree_search_pred(key, &f, &prev);
+    if (!f || !live(ptr)) {
         return {};
     }
     while (ptr != nullptr && result.size() < size)
     {
-        result.push_back(*(ptr->value));
+        if (live(ptr))
+            result.push_back(*(ptr->value));
         ptr = ptr->next;
     }
     return result;